@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lgb.h"
+
+/* Compares running many copies of one game one after the other with
+ * lgb_run_frame against lgb_lockstep_run_frame. The copies start from
+ * states a few frames apart so they are close but not in step, like
+ * agents exploring from one start. Links liblgb.a. */
+
+static void usage(const char *name){
+    printf("Usage %s [-n instances] [-f frames] [-s spread] <gameboy rom>\n", name);
+    printf("  -n  copies of the game, 16 if not given\n");
+    printf("  -f  frames each runs, 600 if not given\n");
+    printf("  -s  copy i presses start on frame 400 + i * spread, 0 by default\n");
+}
+
+static double seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned char *read_file(const char *filename, size_t *size){
+    FILE *file = fopen(filename, "rb");
+    if(!file){
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    unsigned char *data = malloc(*size);
+    if(fread(data, 1, *size, file) != *size){
+        fprintf(stderr, "Unable to read %s\n", filename);
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+static Lgb **create(const int n, const unsigned char *rom, const size_t size){
+    Lgb **instances = malloc(sizeof(Lgb *) * n);
+    for(int i = 0; i < n; i++){
+        instances[i] = lgb_create();
+        if(lgb_load_rom_from_memory(instances[i], rom, size) != 0)
+            return NULL;
+    }
+    return instances;
+}
+
+int main(int argc, char **argv){
+    int n = 16, frames = 600, spread = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "n:f:s:")) != -1){
+        switch(opt){
+        case 'n': n = atoi(optarg); break;
+        case 'f': frames = atoi(optarg); break;
+        case 's': spread = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if(optind != argc - 1 || n <= 0 || frames <= 0){
+        usage(argv[0]);
+        return 1;
+    }
+    size_t size;
+    unsigned char *rom = read_file(argv[optind], &size);
+    if(!rom)
+        return 1;
+    Lgb **separate = create(n, rom, size);
+    Lgb **lockstep = create(n, rom, size);
+    if(!separate || !lockstep){
+        fprintf(stderr, "Unable to load %s\n", argv[optind]);
+        return 1;
+    }
+
+    /* Warm up each copy and give both sets the same states */
+    for(int i = 0; i < n; i++){
+        int press = 400 + i * spread;
+        for(int frame = 0; frame < press + 60; frame++){
+            lgb_set_buttons(separate[i], frame >= press && frame < press + 10 ?
+                            LGB_BUTTON_START : 0);
+            lgb_run_frame(separate[i]);
+        }
+        size_t state_size = lgb_save_state(separate[i], NULL, 0);
+        void *state = malloc(state_size);
+        lgb_save_state(separate[i], state, state_size);
+        if(lgb_load_state(lockstep[i], state, state_size) != 0){
+            fprintf(stderr, "Unable to copy the state of copy %d\n", i);
+            return 1;
+        }
+        free(state);
+    }
+
+    double start = seconds();
+    for(int frame = 0; frame < frames; frame++)
+        for(int i = 0; i < n; i++)
+            lgb_run_frame(separate[i]);
+    double separate_time = seconds() - start;
+
+    LgbLockstepStats stats = {0};
+    start = seconds();
+    for(int frame = 0; frame < frames; frame++)
+        lgb_lockstep_run_frame(lockstep, n, &stats);
+    double lockstep_time = seconds() - start;
+
+    int mismatches = 0;
+    for(int i = 0; i < n; i++)
+        if(memcmp(lgb_get_framebuffer(separate[i]), lgb_get_framebuffer(lockstep[i]),
+                  LGB_WIDTH * LGB_HEIGHT) != 0)
+            mismatches++;
+
+    unsigned long instructions = stats.vector_instructions + stats.scalar_instructions;
+    printf("%d copies, %d frames\n", n, frames);
+    printf("separate: %.3f s, %.0f frames/s\n", separate_time,
+           n * frames / separate_time);
+    printf("lockstep: %.3f s, %.0f frames/s, %.2fx\n", lockstep_time,
+           n * frames / lockstep_time, separate_time / lockstep_time);
+    printf("vectorised: %.1f%% of %lu instructions, %.1f lanes per vector step\n",
+           instructions ? 100.0 * stats.vector_instructions / instructions : 0,
+           instructions, stats.vector_steps ?
+           (double)stats.vector_instructions / stats.vector_steps : 0);
+    printf("frames differing: %d\n", mismatches);
+
+    for(int i = 0; i < n; i++){
+        lgb_destroy(separate[i]);
+        lgb_destroy(lockstep[i]);
+    }
+    free(separate);
+    free(lockstep);
+    free(rom);
+    return mismatches ? 1 : 0;
+}
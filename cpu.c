@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <json-c/json.h>
 #include "cpu.h"
 #include "cpu_timings.h"
@@ -7,14 +9,15 @@
 #include "defs.h"
 #include "mem.h"
 #include "gpu.h"
-#include "timer.h"
+#include "timer-new.h"
 
-Cpu *cpu;
+_Thread_local Cpu *cpu;
 
 static unsigned int load_json(const json_object *med_obj,
 			      const unsigned int opcode, const int pos,
 			      const char *prefix);
-json_object *med_obj;
+json_object *med_obj; // shared by every instance, only read once parsed
+static pthread_once_t med_obj_once = PTHREAD_ONCE_INIT;
 
 
 static inline u8 read(u16 addr){
@@ -2471,7 +2474,9 @@ static void interrupt(u16 address)
     write(--cpu->SP, (cpu->PC & 0xFF));
     cpu->PC = address;
     timer_tick(12);
-    gpu_step(12);
+    gpu->pending += 12;
+    if(gpu->pending >= gpu->deadline)
+	gpu_sync();
 }
 
 void print_cpu()
@@ -2499,6 +2504,7 @@ void cpu_init()
     cpu->interrupt_master_enable = 0;
     cpu->cpu_halt = 0;
     cpu->cpu_exit_loop = 0;
+    cpu->step_request = 0;
     cpu->PC_skip = 0;
     cpu->interrupt_skip = 0;
 }
@@ -2508,6 +2514,25 @@ void cpu_exit()
     cpu->cpu_exit_loop = 1;
 }
 
+/* Lets cpu_run go again after cpu_exit */
+void cpu_resume()
+{
+    cpu->cpu_exit_loop = 0;
+}
+
+/* From the UI thread, which mustn't run the CPU itself. Only while
+ * paused, the thread running it does the step once it's parked */
+void cpu_request_step()
+{
+    if(cpu->cpu_exit_loop)
+	cpu->step_request = 1;
+}
+
+int cpu_take_step_request()
+{
+    return atomic_exchange(&cpu->step_request, 0);
+}
+
 void cpu_run_once()
 {
     print_cpu();
@@ -2536,66 +2561,93 @@ static unsigned int load_json(const json_object *med_obj,
 	return json_object_get_int(json_object_array_get_idx(medj_array, pos ? 0 : 1));
 }
 
-void cpu_run()
-{
-    static const char filename[] = "opcodes.json";
-    med_obj = json_object_from_file(filename);
-    if (!med_obj) {
-	fprintf(stderr, "load JSON data from %s failed.\n", filename);
-	return;
-    }
+static const char opcodes_filename[] = "opcodes.json";
 
+static void load_opcodes()
+{
+    med_obj = json_object_from_file(opcodes_filename);
+}
 
-    while(!cpu->cpu_exit_loop) {
-	cpu->cycle_counter = 0;
-	cpu->jump_taken = 0;
-	if(cpu->cpu_halt){
-	    cpu->cycle_counter += 4;
-	}else{
-	    // Read next instruction from PC
-	    // but don't increment it
-	    if(cpu->PC_skip){
-		cpu_step(read(cpu->PC));
-		cpu->PC_skip = 0;
+/* Brings the timer and PPU up to date after an instruction that took
+ * cycles and takes a pending interrupt */
+void cpu_account(const unsigned int cycles)
+{
+    timer_tick(cycles);
+    gpu->pending += cycles;
+    if(gpu->pending >= gpu->deadline)
+	gpu_sync();
+
+    if((cpu->interrupt_master_enable || cpu->cpu_halt) && memory->interrupt_enable && memory->interrupt_flags) {
+	int fired = memory->interrupt_enable & memory->interrupt_flags;
+	cpu->cpu_halt = 0;
+	if(cpu->interrupt_skip)
+	    cpu->interrupt_skip = 0;
+	else {
+	    if(fired & 0x01) { // VBLANK
+		memory->interrupt_flags &= ~0x01;
+		interrupt(0x0040);
 	    }
-	    else{
-		u8 tmp = pc_read();
-		cpu_step(tmp);
-		u8 cycles = load_json(med_obj, tmp, cpu->jump_taken ? 1 : 0, "unprefixed");
-		if(cpu->cycle_counter != cycles && tmp != 0xCB)
-		    printf("!!!! expected %d got %d opcode %X\n", cycles, cpu->cycle_counter, tmp);
+	    else if(fired & 0x02) { //LCD STAT
+		memory->interrupt_flags &= ~0x02;
+		interrupt(0x0048);
 	    }
-	}
-	timer_tick(cpu->cycle_counter);
-	gpu_step(cpu->cycle_counter);
-
-        if((cpu->interrupt_master_enable || cpu->cpu_halt) && memory->interrupt_enable && memory->interrupt_flags) {
-            int fired = memory->interrupt_enable & memory->interrupt_flags;
-	    cpu->cpu_halt = 0;
-	    if(cpu->interrupt_skip)
-		cpu->interrupt_skip = 0;
-	    else {
-		if(fired & 0x01) { // VBLANK
-		    memory->interrupt_flags &= ~0x01;
-		    interrupt(0x0040);
-		}
-		else if(fired & 0x02) { //LCD STAT
-		    memory->interrupt_flags &= ~0x02;
-		    interrupt(0x0048);
-		}
-		else if(fired & 0x04) { // TIMER
-		    memory->interrupt_flags &= ~0x04;
-		    interrupt(0x0050);
-		}
-		else if(fired & 0x08) { // SERIAL
-		    memory->interrupt_flags &= ~0x08;
-		    interrupt(0x0058);
-		}
-		else if(fired & 0x10) { // Joypad
-		    memory->interrupt_flags &= ~0x10;
-		    interrupt(0x0060);
-		}
+	    else if(fired & 0x04) { // TIMER
+		memory->interrupt_flags &= ~0x04;
+		interrupt(0x0050);
 	    }
-        }
+	    else if(fired & 0x08) { // SERIAL
+		memory->interrupt_flags &= ~0x08;
+		interrupt(0x0058);
+	    }
+	    else if(fired & 0x10) { // Joypad
+		memory->interrupt_flags &= ~0x10;
+		interrupt(0x0060);
+	    }
+	}
+    }
+}
+
+/* One instruction, or four cycles of HALT */
+void cpu_run_instruction()
+{
+    cpu->cycle_counter = 0;
+    cpu->jump_taken = 0;
+    if(cpu->cpu_halt){
+	cpu->cycle_counter += 4;
+    }else{
+	// Read next instruction from PC
+	// but don't increment it
+	if(cpu->PC_skip){
+	    cpu_step(read(cpu->PC));
+	    cpu->PC_skip = 0;
+	}
+	else{
+	    u8 tmp = pc_read();
+	    cpu_step(tmp);
+	    u8 cycles = load_json(med_obj, tmp, cpu->jump_taken ? 1 : 0, "unprefixed");
+	    if(cpu->cycle_counter != cycles && tmp != 0xCB)
+		printf("!!!! expected %d got %d opcode %X\n", cycles, cpu->cycle_counter, tmp);
+	}
     }
+    cpu_account(cpu->cycle_counter);
+}
+
+/* The opcode cycle table every instance checks against, read once */
+int cpu_load_opcodes()
+{
+    // parsed once, cpu_run is called again after every stop
+    pthread_once(&med_obj_once, load_opcodes);
+    if (!med_obj) {
+	fprintf(stderr, "load JSON data from %s failed.\n", opcodes_filename);
+	return -1;
+    }
+    return 0;
+}
+
+void cpu_run()
+{
+    if(cpu_load_opcodes() != 0)
+	return;
+    while(!cpu->cpu_exit_loop)
+	cpu_run_instruction();
 }
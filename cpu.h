@@ -6,8 +6,14 @@
 
 extern void cpu_init();
 extern void cpu_exit();
+extern void cpu_resume();
 extern void cpu_run();
+extern void cpu_run_instruction();
+extern void cpu_account(const unsigned int cycles);
+extern int cpu_load_opcodes();
 extern void cpu_run_once();
+extern void cpu_request_step();
+extern int cpu_take_step_request();
 static void print_cpu();
 
 typedef struct{
@@ -26,11 +32,14 @@ typedef struct{
     unsigned long cpu_time;
     int cpu_halt;
     int cpu_stop;
-    int cpu_exit_loop;
+    _Atomic int cpu_exit_loop; // set from the UI thread too
+    _Atomic int step_request; // single step asked for by the UI thread
     int PC_skip; // HALT bug
     int interrupt_skip; // Doesn't jump to interrupt vector
     unsigned long cycle_counter;
     unsigned long jump_taken;
 }Cpu;
 
+extern _Thread_local Cpu *cpu;
+
 #endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 
 #include "display.h"
@@ -6,9 +7,8 @@
 #include "types.h"
 #include "cpu.h"
 #include "mem.h"
+#include "joypad.h"
 
-#define TILE_WIDTH 256
-#define TILE_HEIGHT 96
 
 typedef struct {
     SDL_Window *window;
@@ -18,41 +18,39 @@ typedef struct {
 } Window;
 
 Window *window;
-Window *tile_window;
-Window *disp_mem_window;
+Window *debug_window;
 
-Key *key;
 Display display;
 
 static void key_up(SDL_Scancode skey){
     switch(skey){
     case SDL_SCANCODE_RETURN://start
-        key->rows[0] |= 0x08;
+        joypad_release(JOYPAD_START);
         break;
     case SDL_SCANCODE_LSHIFT://select
-        key->rows[0] |= 0x04;
+        joypad_release(JOYPAD_SELECT);
         break;
     case SDL_SCANCODE_X://b
-        key->rows[0] |= 0x02;
+        joypad_release(JOYPAD_B);
         break;
     case SDL_SCANCODE_Z://a
-        key->rows[0] |= 0x01;
+        joypad_release(JOYPAD_A);
         break;
     case SDL_SCANCODE_DOWN://down
     case SDL_SCANCODE_K:
-        key->rows[1] |= 0x08;
+        joypad_release(JOYPAD_DOWN);
         break;
     case SDL_SCANCODE_UP://up
     case SDL_SCANCODE_I:
-        key->rows[1] |= 0x04;
+        joypad_release(JOYPAD_UP);
         break;
     case SDL_SCANCODE_LEFT://left
     case SDL_SCANCODE_J:
-        key->rows[1] |= 0x02;
+        joypad_release(JOYPAD_LEFT);
         break;
     case SDL_SCANCODE_RIGHT://right
     case SDL_SCANCODE_L:
-        key->rows[1] |= 0x01;
+        joypad_release(JOYPAD_RIGHT);
         break;
     case SDL_SCANCODE_ESCAPE:
         cpu_exit();
@@ -61,7 +59,10 @@ static void key_up(SDL_Scancode skey){
         cpu_exit();
         break;
     case SDL_SCANCODE_S:
-        cpu_run_once();
+        cpu_request_step();
+        break;
+    case SDL_SCANCODE_TAB://fast forward while held
+        pacer_fast_forward(0);
         break;
     default:
         fprintf(stderr,"Key %s not used\n", SDL_GetScancodeName(skey));
@@ -69,57 +70,44 @@ static void key_up(SDL_Scancode skey){
     }
 }
 
-static void key_down(SDL_Scancode skey){//clear the right bit
+static void key_down(SDL_Scancode skey){
     switch(skey){
     case SDL_SCANCODE_RETURN://start
-        key->rows[0] &= 0x07;
+        joypad_press(JOYPAD_START);
         break;
     case SDL_SCANCODE_LSHIFT://select
-        key->rows[0] &= 0x0B;
+        joypad_press(JOYPAD_SELECT);
         break;
     case SDL_SCANCODE_X://b
-        key->rows[0] &= 0x0D;
+        joypad_press(JOYPAD_B);
         break;
     case SDL_SCANCODE_Z://a
-        key->rows[0] &= 0x0E;
+        joypad_press(JOYPAD_A);
         break;
     case SDL_SCANCODE_DOWN://down
     case SDL_SCANCODE_K:
-        key->rows[1] &= 0x07;
+        joypad_press(JOYPAD_DOWN);
         break;
     case SDL_SCANCODE_UP://up
     case SDL_SCANCODE_I:
-        key->rows[1] &= 0x0B;
+        joypad_press(JOYPAD_UP);
         break;
     case SDL_SCANCODE_LEFT://left
     case SDL_SCANCODE_J:
-        key->rows[1] &= 0x0D;
+        joypad_press(JOYPAD_LEFT);
         break;
     case SDL_SCANCODE_RIGHT://right
     case SDL_SCANCODE_L:
-        key->rows[1] &= 0x0E;
+        joypad_press(JOYPAD_RIGHT);
         break;
-    default:
+    case SDL_SCANCODE_TAB:
+        pacer_fast_forward(1);
         break;
-    }
-}
-
-inline u8 display_get_key(){
-    switch(key->column){
-    case 0x10:
-      return key->rows[0];
-    case 0x20:
-      return key->rows[1];
     default:
-        fprintf(stderr,"Key not recognised %d\n",key->column);
-        return 0;
+        break;
     }
 }
 
-inline void display_set_key(u8 value){
-    key->column = value & 0x30;
-}
-
 void display_get_input(){//gets the current input to the display
     SDL_Event event;
     while(SDL_PollEvent(&event)){
@@ -138,112 +126,345 @@ void display_get_input(){//gets the current input to the display
     }
 }
 
-void display_redraw(){
-    Uint32 *p;
-    for(int y = 0; y < HEIGHT; y++){
-        for(int x = 0; x < WIDTH; x++){
-            p = &window->pixels[y * WIDTH + x];
-            switch(gpu->screen[y][x]){
-            case 0:// White
-                *p = 0xFFFFFFFF;
-                break;
-            case 1: // Light gray
-                *p = 0xFF808080;
-                break;
-            case  2: // Dark gray
-                *p = 0xFF404040;
-                break;
-            case 3: // Black
-                *p = 0xFF000000;
-                break;
-	    default: // Red for error pixel
-		*p = 0xFFFF0000;
-                break;
-            }
+/* Shades 0-3 to ARGB, anything else can't come out of the palettes */
+static const Uint32 shade_argb[4] = {
+    0xFFFFFFFF, // White
+    0xFF808080, // Light gray
+    0xFF404040, // Dark gray
+    0xFF000000, // Black
+};
+
+/* Eight pixels at a time. The shades index the colours with a shuffle,
+ * so a line converts without a load per pixel */
+typedef u8 Shades __attribute__((vector_size(8)));
+typedef Shades UnalignedShades __attribute__((aligned(1)));
+typedef Uint32 Pixels __attribute__((vector_size(32)));
+
+static const Pixels shade_pixels = {
+    0xFFFFFFFF, 0xFF808080, 0xFF404040, 0xFF000000,
+    0xFFFFFFFF, 0xFF808080, 0xFF404040, 0xFF000000,
+};
+
+#define load_shades(line) \
+    __builtin_convertvector(*(const UnalignedShades *)(line), Pixels)
+#define argb(shades) __builtin_shuffle(shade_pixels, (shades) & 3)
+
+__attribute__((target_clones("avx2", "default")))
+static void convert_line(const u8 *line, Uint32 *p){
+    for(int x = 0; x < WIDTH; x += 8){
+        Pixels pixels = argb(load_shades(line + x));
+        memcpy(p + x, &pixels, sizeof(pixels));
+    }
+}
+
+/* Each shade a quarter darker, for the gaps between LCD cells */
+#define darken(colours) (0xFF000000 | (((colours) >> 2) & 0x3F3F3F) * 3)
+/* Lanes of a where mask is set, of b elsewhere */
+#define select(mask, a, b) (((a) & (Pixels)(mask)) | ((b) & ~(Pixels)(mask)))
+
+/* Scaling by n turns every 8 pixels into n vectors of 8. Vector k of
+ * them takes its pixels from lanes spread[k] of the 8, and with the LCD
+ * grid darkens the lanes set in gap[k]. Worked out when the scale is set */
+static Pixels spread[6];
+static Pixels gap[6];
+
+#define store_pixels(out, pixels) \
+    do{ Pixels p_ = (pixels); memcpy((out), &p_, sizeof(p_)); }while(0)
+
+/* Scale2x/EPX: each pixel E becomes 2x2, corners take the colour of the
+ * neighbours B above, D left, F right and H below when they make an edge
+ * through it */
+__attribute__((target_clones("avx2", "default")))
+static void scale2x_line(const Frame *frame, const int y, Uint32 *out, const int stride){
+    const u8 *above = (*frame)[y > 0 ? y - 1 : y];
+    const u8 *row = (*frame)[y];
+    const u8 *below = (*frame)[y < HEIGHT - 1 ? y + 1 : y];
+    u8 padded[WIDTH + 16]; // row with its end pixels repeated either side
+    memcpy(padded + 8, row, WIDTH);
+    padded[7] = row[0];
+    padded[WIDTH + 8] = row[WIDTH - 1];
+    const Pixels left = {0, 8, 1, 9, 2, 10, 3, 11};
+    const Pixels right = {4, 12, 5, 13, 6, 14, 7, 15};
+    Uint32 *out2 = out + stride;
+    for(int x = 0; x < WIDTH; x += 8){
+        Pixels b = load_shades(above + x), e = load_shades(row + x);
+        Pixels h = load_shades(below + x);
+        Pixels d = load_shades(padded + 7 + x), f = load_shades(padded + 9 + x);
+        Pixels edge = (Pixels)(b != h) & (Pixels)(d != f);
+        Pixels e0 = argb(select(edge & (Pixels)(d == b), d, e));
+        Pixels e1 = argb(select(edge & (Pixels)(b == f), f, e));
+        Pixels e2 = argb(select(edge & (Pixels)(d == h), d, e));
+        Pixels e3 = argb(select(edge & (Pixels)(h == f), f, e));
+        store_pixels(out + 2 * x, __builtin_shuffle(e0, e1, left));
+        store_pixels(out + 2 * x + 8, __builtin_shuffle(e0, e1, right));
+        store_pixels(out2 + 2 * x, __builtin_shuffle(e2, e3, left));
+        store_pixels(out2 + 2 * x + 8, __builtin_shuffle(e2, e3, right));
+    }
+}
+
+/* One source line scaled by display.scale into rows of the texture */
+__attribute__((target_clones("avx2", "default")))
+static void scale_line(const Frame *frame, const int y, Uint32 *out, const int stride){
+    const int scale = display.scale;
+    const int lcd = display.scaler == SCALER_LCD;
+
+    if(display.scaler == SCALER_SCALE2X){
+        scale2x_line(frame, y, out, stride);
+        return;
+    }
+
+    const u8 *line = (*frame)[y];
+    Uint32 *o = out;
+    for(int x = 0; x < WIDTH; x += 8){
+        Pixels pixels = argb(load_shades(line + x));
+        for(int k = 0; k < scale; k++, o += 8){
+            Pixels scaled = __builtin_shuffle(pixels, spread[k]);
+            if(lcd)
+                scaled = select(gap[k], darken(scaled), scaled);
+            store_pixels(o, scaled);
+        }
+    }
+    for(int i = 1; i < scale; i++)
+        memcpy(out + i * stride, out, WIDTH * scale * sizeof(Uint32));
+    if(lcd){
+        Uint32 *bottom = out + (scale - 1) * stride;
+        for(int x = 0; x < WIDTH * scale; x += 8){
+            Pixels pixels;
+            memcpy(&pixels, out + x, sizeof(pixels));
+            store_pixels(bottom + x, darken(pixels));
+        }
+    }
+}
+
+void display_redraw(const int buffer){
+    const Frame *frame = gpu_get_frame(buffer);
+    const u64 *hashes = gpu_frame_line_hashes(buffer);
+    const int scale = display.scale;
+    if(display.presented && gpu_frame_hash(buffer) == display.frame_hash){
+        // same picture as on screen, nothing to convert or upload
+        return;
+    }
+    /* Upload each run of lines that differ from the texture */
+    int y = 0;
+    while(y < HEIGHT){
+        if(display.presented && hashes[y] == display.line_hash[y]){
+            y++;
+            continue;
+        }
+        int first = y;
+        while(y < HEIGHT && (!display.presented || hashes[y] != display.line_hash[y]))
+            y++;
+        int last = y;
+        if(display.scaler == SCALER_SCALE2X){
+            // the lines either side of a change look at it too
+            if(first > 0)
+                first--;
+            if(last < HEIGHT)
+                last++;
+        }
+        SDL_Rect rect = {0, first * scale, WIDTH * scale, (last - first) * scale};
+        /* Converted straight into the texture, nothing is copied after */
+        void *pixels;
+        int pitch;
+        if(SDL_LockTexture(window->texture, &rect, &pixels, &pitch) != 0){
+            fprintf(stderr,"Unable to lock texture: %s\n", SDL_GetError());
+            return; // not drawn, so not the frame on screen either
+        }
+        for(int i = first; i < last; i++){
+            Uint32 *out = (Uint32 *)((u8 *)pixels + (i - first) * scale * pitch);
+            if(scale == 1)
+                convert_line((*frame)[i], out);
+            else
+                scale_line(frame, i, out, pitch / sizeof(Uint32));
+            display.line_hash[i] = hashes[i];
         }
+        SDL_UnlockTexture(window->texture);
     }
-    SDL_UpdateTexture(window->texture, NULL, window->pixels, WIDTH * sizeof(Uint32));
+    display.frame_hash = gpu_frame_hash(buffer);
+    display.presented = 1;
     SDL_RenderClear(window->renderer);
     SDL_RenderCopy(window->renderer, window->texture, NULL, NULL);
     SDL_RenderPresent(window->renderer);
-    display_get_input();//our version of update
 }
 
-void display_tile_map() {
-    Uint32 *p;
-
-    for(int tile = 0; tile < NUM_TILES; tile++) {
-	for(int y = 0; y < 8; y++) {
-	    for(int x = 0; x < 8; x++) {
-		p = &tile_window->pixels[((tile >> 5) * TILE_WIDTH * 8 ) +
-					 (y * TILE_WIDTH) + x + ((tile & 0x1F) * 8)];
-
-		switch(gpu->tiles[tile][y][x]){
-		case 0:// White
-		    *p = 0xFFFFFFFF;
-		    break;
-		case 1: // Light gray
-		    *p = 0xFF808080;
-		    break;
-		case  2: // Dark gray
-		    *p = 0xFF404040;
-		    break;
-		case 3: // Black
-		    *p = 0xFF000000;
-		    break;
-		default: // Red for error pixel
-		    *p = 0xFFFF0000;
-		    break;
-		}
-	    }
-	}
+/* Shows the newest finished frame if there is one the screen doesn't have
+ * yet, returns 0 if there wasn't */
+int display_present(){
+    int buffer = gpu_acquire_frame();
+    if(buffer < 0)
+        return 0;
+    if(gpu_frame_shown(buffer))
+        display_redraw(buffer);
+    return 1;
+}
+
+/* Scale the picture up on the CPU before SDL sees it. Nearest and the LCD
+ * grid take 1 to 6, Scale2x is always 2 */
+int display_set_scaler(const DisplayScaler scaler, const int scale){
+    int factor = scaler == SCALER_SCALE2X ? 2 : scale;
+    if(factor < 1 || factor > 6 || (scaler == SCALER_LCD && factor < 2)){
+        fprintf(stderr,"Scale has to be 1 to 6, 2 to 6 for the LCD grid\n");
+        return -1;
+    }
+    display.scaler = scaler;
+    display.scale = factor;
+    for(int k = 0; k < factor; k++)
+        for(int lane = 0; lane < 8; lane++){
+            spread[k][lane] = (k * 8 + lane) / factor;
+            gap[k][lane] = (k * 8 + lane) % factor == factor - 1 ? ~0u : 0;
+        }
+    SDL_DestroyTexture(window->texture);
+    window->texture = SDL_CreateTexture(window->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                        SDL_TEXTUREACCESS_STREAMING,
+                                        WIDTH * factor, HEIGHT * factor);
+    if(window->texture == NULL){
+        fprintf(stderr,"Unable to create texture: %s\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_SetWindowSize(window->window, WIDTH * factor, HEIGHT * factor);
+    display.presented = 0;
+    return 0;
+}
+
+/* Debug viewer: both tile maps along the top, the tile data, OAM and the
+ * palettes below. Only tiles and map entries written since the last
+ * update are drawn again, and it updates at most every
+ * DEBUG_INTERVAL_MS so it can stay open at full speed */
+#define MAP_X(map) ((map) * 256)
+#define TILES_Y 256
+#define OAM_X 256
+#define OAM_Y 256
+#define PALETTES_X 432
+#define PALETTES_Y 256
+
+static int tile_dirty(const int tile){
+    return display.debug.copy.dirty_tiles[tile >> 5] & (1u << (tile & 31));
+}
+
+/* 8x8 tile at x, y of the debug window. colours maps the shades through a
+ * palette, or NULL for the raw shades */
+static void debug_draw_tile(const int tile, const u8 *colours, const int x, const int y){
+    for(int ty = 0; ty < 8; ty++){
+        Uint32 *p = &debug_window->pixels[(y + ty) * DEBUG_WIDTH + x];
+        for(int tx = 0; tx < 8; tx++){
+            u8 shade = display.debug.copy.tiles[tile][ty][tx];
+            p[tx] = shade_argb[(colours ? colours[shade] : shade) & 3];
+        }
     }
-    SDL_UpdateTexture(tile_window->texture, NULL,
-		      tile_window->pixels, TILE_WIDTH * sizeof(Uint32));
-    SDL_RenderClear(tile_window->renderer);
-    SDL_RenderCopy(tile_window->renderer, tile_window->texture, NULL, NULL);
-    SDL_RenderPresent(tile_window->renderer);
 }
 
-void display_gpu_memory() {
-    Uint32 *p;
-    u16 memory = 0x8000;
-    for(int tile = 0; tile < 384; tile++) {
-	for(int y = 0; y < 8; y++) {
-	    u8 low = get_mem(memory);
-	    u8 high = get_mem(memory + 1);
-	    memory += 2;
-	    for(int x = 0; x < 8; x++) {
-		int sx = 1 << (7 - x);
-		p = &disp_mem_window->pixels[((tile >> 5) * TILE_WIDTH * 8 ) +
-					    (y * TILE_WIDTH) + x + ((tile & 0x1F) * 8)];
-		u8 shade = (low & sx ? 1 : 0) | (high & sx ? 2 : 0);
-
-		switch(shade){
-		case 0:// White
-		    *p = 0xFFFFFFFF;
-		    break;
-		case 1: // Light gray
-		    *p = 0xFF808080;
-		    break;
-		case  2: // Dark gray
-		    *p = 0xFF404040;
-		    break;
-		case 3: // Black
-		    *p = 0xFF000000;
-		    break;
-		default: // Red for error pixel
-		    *p = 0xFFFF0000;
-		    break;
-		}
-	    }
-	}
+/* Tile number of a map entry with the current tile data addressing */
+static int map_tile(const int entry){
+    int tile = display.debug.copy.map[entry];
+    if(display.debug.copy.tile_data_select == 0x8800 && tile < 128)
+        tile += 256;
+    return tile;
+}
+
+static void debug_draw_sprite(const int i){
+    const GpuDebugCopy *c = &display.debug.copy;
+    const Sprite *sprite = &c->sprites[i];
+    const u8 *colours = sprite->palette ? c->object_palette1_colours :
+        c->object_palette0_colours;
+    int height = c->sprite_size ? 16 : 8;
+    int x = OAM_X + (i % 10) * 16 + 4;
+    int y = OAM_Y + (i / 10) * 16;
+    for(int sy = 0; sy < 16; sy++){
+        Uint32 *p = &debug_window->pixels[(y + sy) * DEBUG_WIDTH + x];
+        for(int sx = 0; sx < 8; sx++){
+            if(sy >= height){
+                p[sx] = 0xFF202020;
+                continue;
+            }
+            int row = sprite->yflip ? height - 1 - sy : sy;
+            int tile = c->sprite_size ? (sprite->tile & 0xFE) + (row >> 3) : sprite->tile;
+            u8 shade = c->tiles[tile][row & 7][sprite->xflip ? 7 - sx : sx];
+            p[sx] = shade ? shade_argb[colours[shade] & 3] : 0xFF202020;
+        }
     }
-    SDL_UpdateTexture(disp_mem_window->texture, NULL,
-		       disp_mem_window->pixels, TILE_WIDTH * sizeof(Uint32));
-    SDL_RenderClear(disp_mem_window->renderer);
-    SDL_RenderCopy(disp_mem_window->renderer, disp_mem_window->texture, NULL, NULL);
-    SDL_RenderPresent(disp_mem_window->renderer);
+}
+
+static void debug_draw_palettes(){
+    const GpuDebugCopy *c = &display.debug.copy;
+    const u8 *palettes[3] = {c->background_palette_colours,
+                             c->object_palette0_colours,
+                             c->object_palette1_colours};
+    for(int row = 0; row < 3 * 16; row++){
+        Uint32 *p = &debug_window->pixels[(PALETTES_Y + row) * DEBUG_WIDTH + PALETTES_X];
+        for(int x = 0; x < 4 * 16; x++)
+            p[x] = shade_argb[palettes[row / 16][x / 16] & 3];
+    }
+}
+
+void display_debug_update(){
+    DebugView *d = &display.debug;
+    const GpuDebugCopy *c = &d->copy;
+    if(!d->open)
+        return;
+    /* Asks the emulation thread for a copy of the PPU, then draws it once
+     * it has been filled in. Only the copy is read here */
+    if(!d->waiting){
+        if(SDL_GetTicks() - d->last_update < DEBUG_INTERVAL_MS)
+            return;
+        d->last_update = SDL_GetTicks();
+        d->waiting = 1;
+        gpu_request_debug_copy(&d->copy);
+        return;
+    }
+    if(gpu_debug_copy_pending())
+        return;
+    d->waiting = 0;
+
+    int full = !d->drawn;
+    int maps_full = full || c->tile_data_select != d->tile_data_select ||
+        c->background_palette != d->background_palette;
+    int palettes_changed = full || c->background_palette != d->background_palette ||
+        c->object_palette0 != d->object_palette0 ||
+        c->object_palette1 != d->object_palette1;
+    int any_tile = 0;
+    int changed = 0;
+
+    for(int tile = 0; tile < NUM_TILES; tile++){
+        if(full || tile_dirty(tile)){
+            debug_draw_tile(tile, NULL, (tile & 31) * 8, TILES_Y + (tile >> 5) * 8);
+            any_tile = 1;
+        }
+    }
+    for(int entry = 0; entry < 0x800; entry++){
+        int tile = map_tile(entry);
+        if(maps_full || (c->dirty_map[entry >> 5] & (1u << (entry & 31))) ||
+           tile_dirty(tile)){
+            int map = entry >> 10;
+            debug_draw_tile(tile, c->background_palette_colours,
+                            MAP_X(map) + (entry & 31) * 8, ((entry >> 5) & 31) * 8);
+            changed = 1;
+        }
+    }
+    if(full || any_tile || palettes_changed || c->sprite_size != d->sprite_size ||
+       memcmp(c->sprites, d->sprites, sizeof(d->sprites)) != 0){
+        for(int i = 0; i < NUM_SPRITES; i++)
+            debug_draw_sprite(i);
+        memcpy(d->sprites, c->sprites, sizeof(d->sprites));
+        changed = 1;
+    }
+    if(palettes_changed){
+        debug_draw_palettes();
+        changed = 1;
+    }
+    d->tile_data_select = c->tile_data_select;
+    d->sprite_size = c->sprite_size;
+    d->background_palette = c->background_palette;
+    d->object_palette0 = c->object_palette0;
+    d->object_palette1 = c->object_palette1;
+    d->drawn = 1;
+
+    if(!changed && !any_tile)
+        return;
+    SDL_UpdateTexture(debug_window->texture, NULL,
+                      debug_window->pixels, DEBUG_WIDTH * sizeof(Uint32));
+    SDL_RenderClear(debug_window->renderer);
+    SDL_RenderCopy(debug_window->renderer, debug_window->texture, NULL, NULL);
+    SDL_RenderPresent(debug_window->renderer);
 }
 
 void display_create_window(Window *w,
@@ -266,21 +487,25 @@ void display_create_window(Window *w,
 
 void display_init(){
     window = malloc(sizeof(Window));
-    tile_window = malloc(sizeof(Window));
-    disp_mem_window = malloc(sizeof(Window));
-    //set the keys
-    key = malloc(sizeof(Key));
-    for(int i = 0; i < 2; i++){
-        key->rows[i] = 0x0F;
-    }
-    key->column = 0;
     if(SDL_Init(SDL_INIT_VIDEO) != 0){
         fprintf(stderr,"Unable to init SDL: %s\n ", SDL_GetError());
         exit(1);
     }
     atexit(SDL_Quit);
-    display_create_window(tile_window, "tile map", TILE_WIDTH, TILE_HEIGHT);
-    //display_create_window(disp_mem_window, "display memory map", TILE_WIDTH, TILE_HEIGHT);
     display_create_window(window, "lgb", WIDTH, HEIGHT);
     display.exit = 0;
+    display.presented = 0;
+    display.scaler = SCALER_NEAREST;
+    display.scale = 1;
+    display.debug.open = 0;
+}
+
+void display_open_debug(){
+    debug_window = malloc(sizeof(Window));
+    display_create_window(debug_window, "lgb debug", DEBUG_WIDTH, DEBUG_HEIGHT);
+    memset(debug_window->pixels, 0, sizeof(Uint32) * DEBUG_WIDTH * DEBUG_HEIGHT);
+    display.debug.open = 1;
+    display.debug.drawn = 0;
+    display.debug.waiting = 0;
+    display.debug.last_update = SDL_GetTicks() - DEBUG_INTERVAL_MS;
 }
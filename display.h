@@ -4,23 +4,52 @@
 #include <SDL2/SDL.h>
 #include "types.h"
 #include "defs.h"
+#include "gpu.h"
+#include "pacer.h"
 
-typedef struct {
-    u8 rows[2];
-    u8 column;
-}Key;
+typedef enum {
+    SCALER_NEAREST,
+    SCALER_SCALE2X,
+    SCALER_LCD // nearest with the cell edges darkened like the LCD grid
+}DisplayScaler;
+
+#define DEBUG_WIDTH 512
+#define DEBUG_HEIGHT 352
+#define DEBUG_INTERVAL_MS 100 // fastest the debug viewer redraws
+
+/* What the debug viewer last drew */
+typedef struct{
+    int open;
+    int drawn;
+    int waiting; // for the emulation thread to fill in copy
+    Uint32 last_update;
+    u16 tile_data_select;
+    int sprite_size;
+    u8 background_palette;
+    u8 object_palette0;
+    u8 object_palette1;
+    Sprite sprites[NUM_SPRITES];
+    GpuDebugCopy copy; // the PPU as this update draws it
+}DebugView;
 
 typedef struct{
-    int exit;
+    _Atomic int exit;
+    /* what the screen texture holds, to only upload lines that changed */
+    int presented; // a frame has been uploaded
+    u64 frame_hash;
+    u64 line_hash[HEIGHT];
+    DisplayScaler scaler;
+    int scale; // texture pixels per Game Boy pixel
+    DebugView debug;
 }Display;
 
-u8 display_get_key();
-void display_set_key(u8 value);
 void display_init();
-void display_redraw();
+void display_redraw(const int buffer);
+int display_present();
+int display_set_scaler(const DisplayScaler scaler, const int scale);
 void display_get_input();
-void display_tile_map();
-void display_gpu_memory();
+void display_open_debug();
+void display_debug_update();
 
 extern Display display;
 #endif
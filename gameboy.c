@@ -0,0 +1,57 @@
+#include <stdlib.h>
+
+#include "gameboy.h"
+
+_Thread_local Gameboy *gameboy;
+
+/* A new instance, bound to the calling thread */
+Gameboy *gameboy_create(){
+    Gameboy *gb = calloc(1, sizeof(Gameboy));
+    gameboy_bind(gb);
+    cpu_init();
+    mem_init();
+    gpu_init();
+    joypad_init();
+    timer_init();
+    pacer_init();
+    gb->cpu = cpu;
+    gb->memory = memory;
+    gb->gpu = gpu;
+    gb->timer = timer;
+    gb->joypad = joypad;
+    gb->pacer = pacer;
+    return gb;
+}
+
+/* Makes gb the instance the calling thread works on, NULL for none */
+void gameboy_bind(Gameboy *gb){
+    gameboy = gb;
+    cpu = gb ? gb->cpu : NULL;
+    memory = gb ? gb->memory : NULL;
+    gpu = gb ? gb->gpu : NULL;
+    timer = gb ? gb->timer : NULL;
+    joypad = gb ? gb->joypad : NULL;
+    pacer = gb ? gb->pacer : NULL;
+}
+
+/* Stops the instance's threads and frees it, nothing may be running it */
+void gameboy_destroy(Gameboy *gb){
+    if(!gb)
+	return;
+    Gameboy *previous = gameboy == gb ? NULL : gameboy;
+    gameboy_bind(gb);
+    render_thread_stop();
+    recorder_stop();
+    free(memory->rom);
+    free(memory->eram);
+    free(memory);
+    free(gpu->frames);
+    free(gpu->scaled);
+    free(gpu);
+    free(cpu);
+    free(timer);
+    free(joypad);
+    free(pacer);
+    free(gb);
+    gameboy_bind(previous);
+}
@@ -0,0 +1,38 @@
+#ifndef GAMEBOY_H
+#define GAMEBOY_H
+
+#include "cpu.h"
+#include "mem.h"
+#include "gpu.h"
+#include "timer-new.h"
+#include "joypad.h"
+#include "pacer.h"
+#include "render_thread.h"
+#include "recorder.h"
+
+/* Everything one emulated Game Boy owns. The core reaches its parts
+ * through the cpu, memory, gpu, timer, joypad and pacer pointers, which
+ * are thread local: gameboy_bind() points them at an instance for the
+ * calling thread, so instances on different threads run independently.
+ * An instance is run by one thread at a time, a frontend thread may bind
+ * it as well for the calls that are safe from another thread. */
+typedef struct{
+    Cpu *cpu;
+    Memory *memory;
+    GPU *gpu;
+    Timer *timer;
+    Joypad *joypad;
+    Pacer *pacer;
+    /* Started and stopped while the instance runs, so these are only
+     * reached through gameboy and never copied to thread locals */
+    RenderThread *render;
+    Recorder *recorder;
+}Gameboy;
+
+extern _Thread_local Gameboy *gameboy;
+
+Gameboy *gameboy_create();
+void gameboy_bind(Gameboy *gb);
+void gameboy_destroy(Gameboy *gb);
+
+#endif
@@ -1,12 +1,20 @@
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "gpu.h"
 #include "defs.h"
 #include "types.h"
 #include "cpu.h"
 #include "mem.h"
-#include "display.h"
+#include "render_thread.h"
+#include "recorder.h"
+#include "pacer.h"
 
-GPU *gpu;
+_Thread_local GPU *gpu;
+
+static int cycles_to_event();
+static void stat_update();
+static void lcd_control_decode(GPU *g, const u8 value);
 
 void gpu_init(){
     gpu = malloc(sizeof(GPU));
@@ -19,23 +27,38 @@ void gpu_init(){
     gpu->window_x = 0;
     gpu->window_y = 0;
 
-    gpu->lcd_control_register = 0x91;
-    gpu->lcd_display_enable = 0;
-    gpu->window_tile_map_display_select = 0x9800;
-    gpu->window_display_enable = 0;
-    gpu->tile_data_select = 0x8800;
-    gpu->background_tile_map_display = 0x9800;
-    gpu->background_display_enable = 0;
-    gpu->sprite_display_enable = 0;
+    lcd_control_decode(gpu, 0x91); // as the boot ROM leaves it
     gpu->line_compare = 0;
-    gpu->line_compare_enable = 0;
+    gpu->stat_enable = 0;
+    gpu->stat_line = 0;
+    gpu->threaded_render = 0;
+    gpu->pending = 0;
+    gpu->deadline = 0;
+    gpu->off_clock = 0;
+    gpu->frame_skip = 0;
+    gpu->skipped_frames = 0;
+    gpu->skip_frame = 0;
+    gpu->output_line = NULL;
+    gpu->output = NULL;
+    gpu->scaled = NULL;
+    atomic_init(&gpu->debug_copy, NULL);
+    for(int i = 0; i < NUM_TILES / 32; i++)
+      atomic_init(&gpu->dirty_tiles[i], 0);
+    for(int i = 0; i < 0x800 / 32; i++)
+      atomic_init(&gpu->dirty_map[i], 0);
+    gpu->backend = GPU_BACKEND_LINE;
+    gpu->mode3_length = SCAN_VRAM_TIME;
+    memset(&gpu->fifo, 0, sizeof(PixelFifo));
 
-    for(int y = 0; y < HEIGHT; y++){
-        for(int x = 0;x < WIDTH; x++){
-            gpu->screen[y][x] = 0;
-            gpu->frame_buffer[y][x] =0;
-        }
-    }
+    gpu->frames = malloc(sizeof(FrameRing));
+    memset(gpu->frames->buffers, 0, sizeof(gpu->frames->buffers));
+    memset(gpu->frames->shown, 0, sizeof(gpu->frames->shown));
+    memset(gpu->frames->line_hash, 0, sizeof(gpu->frames->line_hash));
+    memset(gpu->frames->hash, 0, sizeof(gpu->frames->hash));
+    gpu->frames->back = 0;
+    atomic_init(&gpu->frames->ready, 1);
+    gpu->frames->front = 2;
+    atomic_init(&gpu->frames->completed, 0);
     memset(gpu->sprites, 0, sizeof(Sprite) * 40);
     gpu_set_palette(0xFC, BACKGROUND_PALETTE );
     gpu_set_palette(0xFF, OBJECT_PALETTE0);
@@ -43,17 +66,24 @@ void gpu_init(){
 }
 
 u8 gpu_get_line(){
+    gpu_sync();
     return gpu->line & 0xFF;
 }
 /* Writing to the gpu line register will reset it */
 void gpu_set_line(){
+  gpu_sync();
   gpu->line = 0;
+  stat_update();
+  gpu->deadline = cycles_to_event();
 }
 u8 gpu_get_line_compare(){
   return gpu->line_compare & 0xFF;
 }
 void gpu_set_line_compare(const u8 value){
+  gpu_sync();
   gpu->line_compare = value;
+  stat_update();
+  gpu->deadline = cycles_to_event();
 }
 
 u8 gpu_get_palette(const PaletteType palette_type){
@@ -70,22 +100,7 @@ u8 gpu_get_palette(const PaletteType palette_type){
     }
 }
 
-void gpu_set_palette(const u8 value, const PaletteType palette_type){
-    u8 *palette_colours;
-    switch(palette_type){
-    case BACKGROUND_PALETTE:
-	palette_colours = gpu->background_palette_colours;
-	break;
-    case OBJECT_PALETTE0:
-	palette_colours = gpu->object_palette0_colours;
-	break;
-    case OBJECT_PALETTE1:
-	palette_colours = gpu->object_palette1_colours;
-	break;
-    default:
-        fprintf(stderr, "gpu_set_palette: PaletteType not recongised\n");
-        return;
-    }
+static void palette_decode(u8 *palette_colours, const u8 value){
     for(int i = 0; i < 4; i++) {
 	switch((value >> (i * 2)) & 0x03) {
 	case 0: // White or transparent/ignored on sprites
@@ -104,8 +119,139 @@ void gpu_set_palette(const u8 value, const PaletteType palette_type){
     }
 }
 
+static void lcd_control_decode(GPU *g, const u8 value){
+  g->lcd_control_register = value;
+  g->lcd_display_enable = g->lcd_control_register & 0x80 ? 1 : 0;
+  g->window_tile_map_display_select = g->lcd_control_register & 0x40 ?
+    0x9C00 : 0x9800;
+  g->window_display_enable = g->lcd_control_register & 0x20 ? 1 : 0;
+  g->tile_data_select = g->lcd_control_register & 0x10 ? 0x8000 : 0x8800;
+  g->background_tile_map_display = g->lcd_control_register & 0x08 ?
+    0x9C00 : 0x9800;
+  g->sprite_size = g->lcd_control_register & 0x04 ? 1 : 0;
+  g->sprite_display_enable = g->lcd_control_register & 0x02 ? 1 : 0;
+  g->background_display_enable = g->lcd_control_register & 0x01 ? 1 : 0;
+}
+
+static void tile_decode(GPU *g, const u8 *vram, const u16 address){
+  /* Takes 2 bytes at a time
+   * first byte is LSB of a row
+   * second byte is MSB of a row */
+  unsigned int addy = address & 0x1FFE;
+  unsigned int tile_num, y, sx, x;
+  tile_num = addy >> 4;
+  y = (addy >> 1) & 7;
+  for(x = 0; x < 8; x++){
+    sx = 1 << (7 - x);
+    g->tiles[tile_num][y][x] = ((vram[addy] & sx) ? 1 : 0) |
+      ((vram[addy + 1] & sx) ? 2 : 0);
+  }
+}
+
+static void sprite_decode(GPU *g, const u16 address, const u8 value){
+  unsigned int sprite_num = (address - 0xFE00) >> 2;
+  Sprite *sprite;
+  if (sprite_num < 40){
+    sprite = &g->sprites[sprite_num];
+    switch(address & 3){
+    case 0:
+      sprite->y = value - 16; // can go negative
+      break;
+    case 1:
+      sprite->x = value - 8;
+      break;
+    case 2:
+      sprite->tile = value;
+      break;
+    case 3:
+      sprite->palette = (value & 0x10) ? 1 : 0;
+      sprite->xflip = (value & 0x20) ? 1 : 0;
+      sprite->yflip = (value & 0x40) ? 1 : 0;
+      sprite->prio = (value & 0x80) ? 1 : 0; //0=OBJ Above BG, 1=OBJ Behind BG color 1-3
+      break;
+    }
+  }
+}
+
+/* Applies a write that changes what gets drawn (VRAM, OAM and the LCD
+ * registers render_scan looks at) to a PPU state. Both the emulated PPU and
+ * the render thread's shadow copy are updated through here */
+void gpu_apply_write(GPU *g, u8 *vram, const u16 address, const u8 value){
+  if(address >= VIDEO_RAM_START && address <= VIDEO_RAM_END){
+    unsigned int offset = address & 0x1FFF;
+    vram[offset] = value;
+    if(address <= TILE_DATA_END){
+      tile_decode(g, vram, address);
+      atomic_fetch_or_explicit(&g->dirty_tiles[offset >> 9],
+			       1u << ((offset >> 4) & 31), memory_order_relaxed);
+    }else{
+      offset -= 0x1800;
+      atomic_fetch_or_explicit(&g->dirty_map[offset >> 5],
+			       1u << (offset & 31), memory_order_relaxed);
+    }
+    return;
+  }
+  if(address >= 0xFE00 && address < 0xFEA0){
+    sprite_decode(g, address, value);
+    return;
+  }
+  switch(address){
+  case 0xFF40:
+    lcd_control_decode(g, value);
+    break;
+  case 0xFF42:
+    g->scroll_y = value;
+    break;
+  case 0xFF43:
+    g->scroll_x = value;
+    break;
+  case 0xFF47:
+    g->background_palette = value;
+    palette_decode(g->background_palette_colours, value);
+    break;
+  case 0xFF48:
+    g->object_palette0 = value;
+    palette_decode(g->object_palette0_colours, value);
+    break;
+  case 0xFF49:
+    g->object_palette1 = value;
+    palette_decode(g->object_palette1_colours, value);
+    break;
+  case 0xFF4A:
+    g->window_y = value;
+    break;
+  case 0xFF4B:
+    g->window_x = value;
+    break;
+  }
+}
+
+static void gpu_write(const u16 address, const u8 value){
+  gpu_sync();
+  if(gpu->threaded_render)
+    render_thread_write(address, value);
+  gpu_apply_write(gpu, memory->vram, address, value);
+}
+
+void gpu_set_palette(const u8 value, const PaletteType palette_type){
+    switch(palette_type){
+    case BACKGROUND_PALETTE:
+	gpu_write(0xFF47, value);
+	break;
+    case OBJECT_PALETTE0:
+	gpu_write(0xFF48, value);
+	break;
+    case OBJECT_PALETTE1:
+	gpu_write(0xFF49, value);
+	break;
+    default:
+        fprintf(stderr, "gpu_set_palette: PaletteType not recongised\n");
+        return;
+    }
+}
+
 void gpu_set_scroll_x(const u8 value){
-    gpu->scroll_x = value;
+    gpu_write(0xFF43, value);
 }
 
 u8 gpu_get_scroll_x(){
@@ -113,7 +259,7 @@ u8 gpu_get_scroll_x(){
 }
 
 void gpu_set_scroll_y(const u8 value){
-    gpu->scroll_y = value;
+    gpu_write(0xFF42, value);
 }
 
 u8 gpu_get_scroll_y(){
@@ -121,186 +267,206 @@ u8 gpu_get_scroll_y(){
 }
 
 void gpu_set_window_x(const u8 value){
-  gpu->window_x = value;
+  gpu_write(0xFF4B, value);
 }
 u8 gpu_get_window_x(){
   return gpu->window_x;
 }
 void gpu_set_window_y(const u8 value){
-  gpu->window_y = value;
+  gpu_write(0xFF4A, value);
 }
 u8 gpu_get_window_y(){
   return gpu->window_y;
 }
 
+/* With the LCD off the PPU is stopped: LY stays at 0, the mode at 0 and
+ * nothing is drawn or interrupted. The only work left is counting off
+ * frame lengths so the pacer still runs (see gpu_sync) */
+static void lcd_off(){
+  gpu->line = 0;
+  gpu->mode = 0;
+  gpu->clock = 0;
+  gpu->stat_line = 0;
+  gpu->off_clock = 0;
+}
+
+/* Turning it back on starts a new frame from the top */
+static void lcd_on(){
+  gpu->line = 0;
+  gpu->mode = 2;
+  gpu->clock = 0;
+  gpu->mode3_length = SCAN_VRAM_TIME;
+  if(gpu->backend == GPU_BACKEND_FIFO)
+    gpu_fifo_start_frame(gpu);
+  stat_update();
+}
+
 void gpu_set_lcd_control_register(const u8 value){
-  gpu->lcd_control_register = value;
-  gpu->lcd_display_enable = gpu->lcd_control_register & 0x80 ? 1 : 0;
-  gpu->window_tile_map_display_select = gpu->lcd_control_register & 0x40 ?
-    0x9C00 : 0x9800;
-  gpu->window_display_enable = gpu->lcd_control_register & 0x20 ? 1 : 0;
-  gpu->tile_data_select = gpu->lcd_control_register & 0x10 ? 0x8000 : 0x8800;
-  gpu->background_tile_map_display = gpu->lcd_control_register & 0x08 ?
-    0x9C00 : 0x9800;
-  gpu->sprite_size = gpu->lcd_control_register & 0x04 ? 1 : 0;
-  gpu->sprite_display_enable = gpu->lcd_control_register & 0x02 ? 1 : 0;
-  gpu->background_display_enable = gpu->lcd_control_register & 0x01 ? 1 : 0;
+  int was_on = gpu->lcd_display_enable;
+  gpu_write(0xFF40, value);
+  if(was_on && !gpu->lcd_display_enable)
+    lcd_off();
+  else if(!was_on && gpu->lcd_display_enable)
+    lcd_on();
+  gpu->deadline = cycles_to_event();
 }
 
 u8 gpu_get_lcd_control_register(){
   return gpu->lcd_control_register;
 }
 
-void gpu_update_tile(const u16 address, const u8 value){
-  /* Takes 2 bytes at a time
-   * first byte is LSB of a row
-   * second byte is MSB of a row */
-  unsigned int addy = address;
-  unsigned int tile_num, y, sx, x;
-  if(address & 1)
-    addy--;
-  tile_num = ((addy - 0x8000) >> 4);
-  y = (addy >> 1) & 7;
-  for(x = 0; x < 8; x++){
-    sx = 1 << (7 - x);
-    gpu->tiles[tile_num][y][x] = ((get_mem(addy) & sx) ? 1 : 0) |
-      ((get_mem(addy + 1) & sx) ? 2 : 0);
-  }
-  //display_tile_map();
-  //display_gpu_memory();
+void gpu_update_vram(const u16 address, const u8 value){
+  gpu_write(address, value);
 }
 
 void gpu_update_sprite(const u16 address, const u8 value){
-  unsigned int sprite_num = (address - 0xFE00) >> 2;
-  Sprite *sprite;
-  if (sprite_num < 40){
-    sprite = &gpu->sprites[sprite_num];
-    switch(address & 3){
-    case 0:
-      sprite->y = value - 16; // can go negative
-      break;
-    case 1:
-      sprite->x = value - 8;
-      break;
-    case 2:
-      sprite->tile = value;
-      break;
-    case 3:
-      sprite->palette = (value & 0x10) ? 1 : 0;
-      sprite->xflip = (value & 0x20) ? 1 : 0;
-      sprite->yflip = (value & 0x40) ? 1 : 0;
-      sprite->prio = (value & 0x80) ? 1 : 0; //0=OBJ Above BG, 1=OBJ Behind BG color 1-3
-      break;
-    }
+  gpu_write(address, value);
+}
+
+static void reload_write(const u16 address, const u8 value){
+  if(gpu->threaded_render)
+    render_thread_write(address, value);
+  gpu_apply_write(gpu, memory->vram, address, value);
+}
+
+/* Decodes VRAM, OAM and the LCD registers again after they were replaced
+ * wholesale, as loading a state does. Doesn't catch up first, the PPU's
+ * timing was replaced along with them */
+void gpu_reload(){
+  for(unsigned address = VIDEO_RAM_START; address <= VIDEO_RAM_END; address++){
+    if(gpu->threaded_render)
+      render_thread_write(address, memory->vram[address & 0x1FFF]);
+    /* a tile row decodes from both its bytes, the maps aren't decoded */
+    if(address <= TILE_DATA_END && !(address & 1))
+      gpu_apply_write(gpu, memory->vram, address, memory->vram[address & 0x1FFF]);
   }
+  for(int i = 0; i < 0x800 / 32; i++)
+    atomic_store_explicit(&gpu->dirty_map[i], ~0u, memory_order_relaxed);
+  for(unsigned address = 0xFE00; address < 0xFEA0; address++)
+    reload_write(address, memory->oam[address & 0xFF]);
+  reload_write(0xFF40, gpu->lcd_control_register);
+  reload_write(0xFF42, gpu->scroll_y);
+  reload_write(0xFF43, gpu->scroll_x);
+  reload_write(0xFF47, gpu->background_palette);
+  reload_write(0xFF48, gpu->object_palette0);
+  reload_write(0xFF49, gpu->object_palette1);
+  reload_write(0xFF4A, gpu->window_y);
+  reload_write(0xFF4B, gpu->window_x);
 }
 
-static void render_scan(){
-  if(gpu->background_display_enable){
-    unsigned mapoffset = gpu->background_tile_map_display +
-      ((((gpu->line + gpu->scroll_y) & 0xFF) >> 3) << 5);
-    unsigned lineoffset = (gpu->scroll_x >> 3) & 0x1F;
-    unsigned y = (gpu->line + gpu->scroll_y) & 7;
-    unsigned x = gpu->scroll_x & 7;
+/* Draws line g->line into the frame being drawn. Reads tile maps straight
+ * out of vram so it can run against a shadow copy of the PPU state */
+void gpu_render_scan(GPU *g, const u8 *vram){
+  u8 *row = g->frames->buffers[g->frames->back][g->line];
+  if(!g->background_display_enable){
+    /* Every line is drawn in full, the buffer holds an older frame */
+    memset(row, 0, WIDTH);
+    memset(g->scanrow, 0, WIDTH);
+  }else{
+    unsigned mapoffset = g->background_tile_map_display +
+      ((((g->line + g->scroll_y) & 0xFF) >> 3) << 5);
+    unsigned lineoffset = (g->scroll_x >> 3) & 0x1F;
+    unsigned y = (g->line + g->scroll_y) & 7;
+    unsigned x = g->scroll_x & 7;
 
     // Check if the indicies are signed
-    if(gpu->tile_data_select == 0x8800) {
-      unsigned tile = get_mem(mapoffset + lineoffset);
+    if(g->tile_data_select == 0x8800) {
+      unsigned tile = vram[(mapoffset + lineoffset) & 0x1FFF];
       if(tile < 128)
 	tile += 256;
-      u8 *tilerow = gpu->tiles[tile][y];
+      u8 *tilerow = g->tiles[tile][y];
       for(int i = 0; i < WIDTH; i++){
-	gpu->scanrow[i] = tilerow[x];
-	gpu->frame_buffer[gpu->line][i] =
-	  gpu->background_palette_colours[tilerow[x]];
+	g->scanrow[i] = tilerow[x];
+	row[i] =
+	  g->background_palette_colours[tilerow[x]];
 	x++;
 	if(x == 8){
 	  lineoffset = (lineoffset + 1) & 0x1F;
 	  x = 0;
-	  tile = get_mem(mapoffset + lineoffset);
+	  tile = vram[(mapoffset + lineoffset) & 0x1FFF];
 	  if(tile < 128)
 	    tile += 256;
-	  tilerow = gpu->tiles[tile][y];
+	  tilerow = g->tiles[tile][y];
 	}
       }
     }else {
-      u8 *tilerow = gpu->tiles[get_mem(mapoffset + lineoffset)][y];
+      u8 *tilerow = g->tiles[vram[(mapoffset + lineoffset) & 0x1FFF]][y];
       for(int i = 0; i < WIDTH; i++)
 	{
-	  gpu->scanrow[i] = tilerow[x];
-	  gpu->frame_buffer[gpu->line][i] =
-	    gpu->background_palette_colours[tilerow[x]];
+	  g->scanrow[i] = tilerow[x];
+	  row[i] =
+	    g->background_palette_colours[tilerow[x]];
 	  x++;
 	  if(x == 8) {
 	    lineoffset = (lineoffset + 1) & 0x1F;
 	    x = 0;
-	    tilerow = gpu->tiles[get_mem(mapoffset + lineoffset)][y];
+	    tilerow = g->tiles[vram[(mapoffset + lineoffset) & 0x1FFF]][y];
 	  }
 	}
     }
   }
-  if(gpu->window_display_enable && gpu->line >= gpu->window_y){
-    unsigned mapoffset = gpu->window_tile_map_display_select +
-      ((((gpu->line - gpu->window_y) & 0xFF) >> 3) << 5);
+  if(g->window_display_enable && g->line >= g->window_y){
+    unsigned mapoffset = g->window_tile_map_display_select +
+      ((((g->line - g->window_y) & 0xFF) >> 3) << 5);
     unsigned lineoffset = 0;
-    unsigned y = (gpu->line - gpu->window_y) & 7;
+    unsigned y = (g->line - g->window_y) & 7;
     unsigned x = 0;
 
     // Indicies are always signed on the window
-    unsigned tile = get_mem(mapoffset + lineoffset);
+    unsigned tile = vram[(mapoffset + lineoffset) & 0x1FFF];
     if(tile < 128)
       tile += 256;
-    u8 *tilerow = gpu->tiles[tile][y];
-    for(int i = gpu->window_x - 7; i < WIDTH; i++){
+    u8 *tilerow = g->tiles[tile][y];
+    for(int i = g->window_x - 7; i < WIDTH; i++){
       if(i >= 0)
 	{
-	  gpu->scanrow[i] = tilerow[x];
+	  g->scanrow[i] = tilerow[x];
 	  //palette shared with background
-	  gpu->frame_buffer[gpu->line][i] =
-	    gpu->background_palette_colours[tilerow[x]];
+	  row[i] =
+	    g->background_palette_colours[tilerow[x]];
 	}
       x++;
       if(x == 8){
 	lineoffset = (lineoffset + 1) & 0x1F;
 	x = 0;
-	tile = get_mem(mapoffset + lineoffset);
+	tile = vram[(mapoffset + lineoffset) & 0x1FFF];
 	if(tile < 128)
 	  tile += 256;
-	tilerow = gpu->tiles[tile][y];
+	tilerow = g->tiles[tile][y];
       }
     }
   }
-  if(gpu->sprite_display_enable){
+  if(g->sprite_display_enable){
     for(int i = NUM_SPRITES - 1; i >= 0; i--){ // draw in reverse oder
-      Sprite *sprite = &gpu->sprites[i];
-      if(sprite->y <= gpu->line &&
-	 (sprite->y + 8 > gpu->line ||
-	  (gpu->sprite_size && (sprite->y + 16) > gpu->line)))
+      Sprite *sprite = &g->sprites[i];
+      if(sprite->y <= g->line &&
+	 (sprite->y + 8 > g->line ||
+	  (g->sprite_size && (sprite->y + 16) > g->line)))
 	{
 	  u8 *tilerow;
 	  if(sprite->yflip) {
-	    if(gpu->sprite_size && 15 - gpu->line - sprite->y <  8)
-	      tilerow = gpu->tiles[sprite->tile + 1][7 - (gpu->line - sprite->y)];
+	    if(g->sprite_size && 15 - g->line - sprite->y <  8)
+	      tilerow = g->tiles[sprite->tile + 1][7 - (g->line - sprite->y)];
 	    else
-	      tilerow = gpu->tiles[sprite->tile][7 - (gpu->line - sprite->y)];
+	      tilerow = g->tiles[sprite->tile][7 - (g->line - sprite->y)];
 	  } else {
-	    if(gpu->sprite_size && gpu->line - sprite->y > 7 )
-	      tilerow = gpu->tiles[sprite->tile + 1][gpu->line - sprite->y - 8];
+	    if(g->sprite_size && g->line - sprite->y > 7 )
+	      tilerow = g->tiles[sprite->tile + 1][g->line - sprite->y - 8];
 	    else
-	      tilerow = gpu->tiles[sprite->tile][gpu->line - sprite->y];
+	      tilerow = g->tiles[sprite->tile][g->line - sprite->y];
 	  }
 
-	  u8 *palette = sprite->palette ? gpu->object_palette1_colours :
-	    gpu->object_palette0_colours;
+	  u8 *palette = sprite->palette ? g->object_palette1_colours :
+	    g->object_palette0_colours;
 
 	  for(int x = 0; x < 8; x++){
 	    if(sprite->x + x >= 0 && sprite->x + x < WIDTH &&
  		// if the palette index is 0 it's trasparent
 		tilerow[sprite->xflip ? (7 - x) : x] &&
 		// check background priority BG color 0 is always behind OBJ
-	       (!sprite->prio || !gpu->scanrow[sprite->x + x]))
+	       (!sprite->prio || !g->scanrow[sprite->x + x]))
 	      {
-		gpu->frame_buffer[gpu->line][sprite->x + x] =
+		row[sprite->x + x] =
 		  palette[tilerow[sprite->xflip ? (7 - x) : x]];
 	      }
 	  }
@@ -309,35 +475,178 @@ static void render_scan(){
   }
 }
 
+/* Murmur3's 64 bit finaliser, spreads every bit of a word over all of it */
+static u64 mix(u64 word){
+  word ^= word >> 33;
+  word *= 0xff51afd7ed558ccdULL;
+  word ^= word >> 33;
+  word *= 0xc4ceb9fe1a85ec53ULL;
+  word ^= word >> 33;
+  return word;
+}
+
+/* FNV-1a taken a word at a time. Each word is mixed first, plain FNV
+ * leaves a change in a word's top byte in the top bits where a later
+ * word can cancel it */
+static u64 hash_line(const u8 *row){
+  u64 hash = 14695981039346656037ULL;
+  for(int i = 0; i < WIDTH; i += sizeof(u64)){
+    u64 word;
+    memcpy(&word, row + i, sizeof(u64));
+    hash = (hash ^ mix(word)) * 1099511628211ULL;
+  }
+  return mix(hash);
+}
+
+/* Hands the frame that was just drawn over to the presenter. Only the
+ * frame number changes hands, the pixels stay where they were drawn */
+void gpu_finish_frame(GPU *g){
+  FrameRing *ring = g->frames;
+  int index = ring->back;
+  u64 hash = 14695981039346656037ULL;
+  for(int y = 0; y < HEIGHT; y++){
+    ring->line_hash[index][y] = hash_line(ring->buffers[index][y]);
+    hash = (hash ^ ring->line_hash[index][y]) * 1099511628211ULL;
+  }
+  ring->hash[index] = mix(hash);
+  ring->shown[index] = g->lcd_display_enable;
+  if(g->output_line)
+    gpu_output_frame(g, (const Frame *)&ring->buffers[index]);
+  if(g->scaled)
+    gpu_output_scaled(g, (const Frame *)&ring->buffers[index]);
+  if(ring->shown[index])
+    recorder_frame((const Frame *)&ring->buffers[index]);
+  ring->back = atomic_exchange_explicit(&ring->ready, index | FRAME_FRESH,
+					memory_order_acq_rel) & ~FRAME_FRESH;
+  atomic_fetch_add_explicit(&ring->completed, 1, memory_order_release);
+}
+
+/* Called by the presenter. Takes the newest finished frame and returns
+ * its buffer, or -1 if there hasn't been one since the last call */
+int gpu_acquire_frame(){
+  FrameRing *ring = gpu->frames;
+  if(!(atomic_load_explicit(&ring->ready, memory_order_acquire) & FRAME_FRESH))
+    return -1;
+  ring->front = atomic_exchange_explicit(&ring->ready, ring->front,
+					 memory_order_acq_rel) & ~FRAME_FRESH;
+  return ring->front;
+}
+
+const Frame *gpu_get_frame(const int buffer){
+  return (const Frame *)&gpu->frames->buffers[buffer];
+}
+
+int gpu_frame_shown(const int buffer){
+  return gpu->frames->shown[buffer];
+}
+
+u64 gpu_frame_hash(const int buffer){
+  return gpu->frames->hash[buffer];
+}
+
+const u64 *gpu_frame_line_hashes(const int buffer){
+  return gpu->frames->line_hash[buffer];
+}
+
 static void swap_buffers(){
-  unsigned int x,y;
-  for(y=0;y<HEIGHT;y++){
-    for(x=0;x<WIDTH;x++){
-      gpu->screen[y][x] = gpu->frame_buffer[y][x];
-    }
+  if(gpu->threaded_render)
+    render_thread_frame(); // finished on the worker once it gets there
+  else
+    gpu_finish_frame(gpu);
+}
+
+/* Decides if the frame about to start gets drawn. Skipped frames still run
+ * the full mode/LY/interrupt timing, only the pixel work is left out */
+/* From the UI thread. copy is filled in when the next frame starts */
+void gpu_request_debug_copy(GpuDebugCopy *copy){
+  atomic_store_explicit(&gpu->debug_copy, copy, memory_order_release);
+}
+
+int gpu_debug_copy_pending(){
+  return atomic_load_explicit(&gpu->debug_copy, memory_order_acquire) != NULL;
+}
+
+static void debug_copy(){
+  GpuDebugCopy *copy = atomic_load_explicit(&gpu->debug_copy,
+					    memory_order_acquire);
+  if(!copy)
+    return;
+  memcpy(copy->tiles, gpu->tiles, sizeof(copy->tiles));
+  memcpy(copy->map, memory->vram + 0x1800, sizeof(copy->map));
+  memcpy(copy->sprites, gpu->sprites, sizeof(copy->sprites));
+  copy->tile_data_select = gpu->tile_data_select;
+  copy->sprite_size = gpu->sprite_size;
+  copy->background_palette = gpu->background_palette;
+  copy->object_palette0 = gpu->object_palette0;
+  copy->object_palette1 = gpu->object_palette1;
+  memcpy(copy->background_palette_colours, gpu->background_palette_colours, 4);
+  memcpy(copy->object_palette0_colours, gpu->object_palette0_colours, 4);
+  memcpy(copy->object_palette1_colours, gpu->object_palette1_colours, 4);
+  for(int i = 0; i < NUM_TILES / 32; i++)
+    copy->dirty_tiles[i] = atomic_exchange_explicit(&gpu->dirty_tiles[i], 0,
+						    memory_order_relaxed);
+  for(int i = 0; i < 0x800 / 32; i++)
+    copy->dirty_map[i] = atomic_exchange_explicit(&gpu->dirty_map[i], 0,
+						  memory_order_relaxed);
+  atomic_store_explicit(&gpu->debug_copy, NULL, memory_order_release);
+}
+
+static void frame_start(const long late){
+  debug_copy();
+  if(gpu->frame_skip == FRAME_SKIP_AUTO)
+    gpu->skip_frame = late > 0 && gpu->skipped_frames < FRAME_SKIP_AUTO_MAX;
+  else
+    gpu->skip_frame = gpu->skipped_frames < gpu->frame_skip;
+  if(gpu->skip_frame)
+    gpu->skipped_frames++;
+  else
+    gpu->skipped_frames = 0;
+}
+
+void gpu_set_backend(const GpuBackend backend){
+  gpu->backend = backend;
+  gpu->mode3_length = SCAN_VRAM_TIME;
+}
+
+void gpu_set_frame_skip(const int frames){
+  gpu->frame_skip = frames;
+}
+
+int gpu_get_frame_skip(){
+  return gpu->frame_skip;
+}
+
+/* Nominal length of a mode. Mode 3 is only a lower bound with the pixel
+ * FIFO backend, the horizontal blank after it shrinks to match */
+static int mode_duration(const int mode){
+  switch(mode){
+  case 0: return HORIZONTAL_BLANK1_TIME;
+  case 1: return HORIZONTAL_BLANK2_TIME / 10;
+  case 2: return SCAN_OAM_TIME;
+  default: return SCAN_VRAM_TIME;
   }
-  if(gpu->lcd_display_enable)
-    display_redraw();
-#define SLEEP
-#ifdef SLEEP
-  /* Sleep until the frame time is finished */
-  struct timespec frame_end_time;
-  clock_gettime(CLOCK_MONOTONIC, &frame_end_time);
-  long timedelta = FULL_FRAME_TIME_US -
-    ((frame_end_time.tv_nsec - gpu->frame_start_time.tv_nsec) / 1000);
-  if(timedelta > 0 && timedelta < FULL_FRAME_TIME_US)
-    usleep(timedelta);
-
-  /* Set new frame start time */
-  clock_gettime(CLOCK_MONOTONIC, &gpu->frame_start_time);
-#endif
-}
-
-void gpu_step(int op_time){
+}
+
+/* Cycles left in the current mode, for a pixel FIFO mode 3 at least this
+ * many */
+static int mode_remaining(){
+  switch(gpu->mode){
+  case 0:
+    return SCANLINE_TIME - SCAN_OAM_TIME - gpu->mode3_length - gpu->clock;
+  case 3:
+    if(gpu->backend == GPU_BACKEND_FIFO && gpu->clock >= SCAN_VRAM_TIME)
+      return 1;
+    // fall through
+  default:
+    return mode_duration(gpu->mode) - gpu->clock;
+  }
+}
+
+static void gpu_step(int op_time){
   gpu->clock += op_time;
   switch(gpu->mode){
   case 0: //Horizontal Blank lasts 4560 clocks including mode 2 and 3
-    if(gpu->clock >= HORIZONTAL_BLANK1_TIME){
+    if(gpu->clock >= SCANLINE_TIME - SCAN_OAM_TIME - gpu->mode3_length){
       if(gpu->line == HEIGHT - 1){//144 vblank start
 	gpu->mode = 1;
 	memory->interrupt_flags |= 1;
@@ -345,7 +654,7 @@ void gpu_step(int op_time){
 	gpu->mode = 2;
       }
       gpu->curscan += 640;
-      gpu->clock -= HORIZONTAL_BLANK1_TIME;
+      gpu->clock -= SCANLINE_TIME - SCAN_OAM_TIME - gpu->mode3_length;
     }
     break;
   case 1: //Vertical Blank runs 10 times, 4560 clocks total
@@ -356,7 +665,11 @@ void gpu_step(int op_time){
 	gpu->line = 0;
 	gpu->curscan = 0;
 	gpu->mode = 2;
-	swap_buffers();
+	if(!gpu->skip_frame)
+	  swap_buffers();
+	frame_start(pacer_frame());
+	if(gpu->backend == GPU_BACKEND_FIFO)
+	  gpu_fifo_start_frame(gpu);
       }
     }
     break;
@@ -364,23 +677,173 @@ void gpu_step(int op_time){
     if(gpu->clock >= SCAN_OAM_TIME){ //goto vram scanning
       gpu->clock -= SCAN_OAM_TIME;
       gpu->mode = 3;
+      if(gpu->backend == GPU_BACKEND_FIFO)
+	gpu_fifo_start_line(gpu);
     }
     break;
   case 3: //Scanline accessing VRam
-    if(gpu->clock >= SCAN_VRAM_TIME){
+    if(gpu->backend == GPU_BACKEND_FIFO){
+      /* Drawn a dot at a time, mode 3 lasts until all 160 pixels are out
+       * and horizontal blank gets what is left of the line */
+      int used = gpu_fifo_run(gpu, memory->vram, op_time);
+      if(gpu->fifo.lcd_x == WIDTH){
+	gpu->mode3_length = gpu->clock - op_time + used;
+	gpu->clock = op_time - used;
+	gpu->mode = 0;
+	gpu->line++;
+      }
+    }else if(gpu->clock >= SCAN_VRAM_TIME){
       gpu->clock -= SCAN_VRAM_TIME;
       gpu->mode = 0;
-      render_scan();
+      if(gpu->skip_frame){
+	// timing only, nothing gets drawn this frame
+      }else if(gpu->threaded_render)
+	render_thread_line(gpu->line);
+      else
+	gpu_render_scan(gpu, memory->vram);
       gpu->line++;
     }
     break;
   }
+  stat_update();
+}
+/* Level of the STAT interrupt line for a given mode and line */
+static int stat_level(const int mode, const int line){
+  return ((gpu->stat_enable & 0x08) && mode == 0) ||
+    ((gpu->stat_enable & 0x10) && mode == 1) ||
+    ((gpu->stat_enable & 0x20) && mode == 2) ||
+    ((gpu->stat_enable & 0x40) && line == gpu->line_compare);
+}
+
+/* The sources are ORed into one line and only a rising edge requests the
+ * interrupt, so e.g. LYC matching during a mode 0 that already has the
+ * line high doesn't fire again (STAT blocking) */
+static void stat_update(){
+  int level = gpu->lcd_display_enable && stat_level(gpu->mode, gpu->line);
+  if(level && !gpu->stat_line)
+    memory->interrupt_flags |= 0x02;
+  gpu->stat_line = level;
+}
+
+/* Mode and line the PPU moves to at the end of the current mode, the same
+ * transitions gpu_step makes */
+static void next_mode(int *mode, int *line){
+  switch(*mode){
+  case 0:
+    *mode = *line == HEIGHT - 1 ? 1 : 2;
+    break;
+  case 1:
+    if(++*line == HEIGHT + 10){
+      *line = 0;
+      *mode = 2;
+    }
+    break;
+  case 2:
+    *mode = 3;
+    break;
+  case 3:
+    *mode = 0;
+    ++*line;
+    break;
+  }
+}
+
+/* Cycles until the STAT line next rises, or limit if it doesn't before
+ * then. Only called with a STAT source enabled */
+static int cycles_to_stat(const int limit){
+  int mode = gpu->mode, line = gpu->line;
+  int level = gpu->stat_line;
+  int cycles = mode_remaining();
+  /* End of this line is known even when mode 3's length isn't */
+  int line_end = mode == 3 ? SCANLINE_TIME - SCAN_OAM_TIME - gpu->clock : 0;
+  while(cycles < limit){
+    next_mode(&mode, &line);
+    if(stat_level(mode, line) && !level)
+      return cycles;
+    level = stat_level(mode, line);
+    if(line_end){
+      cycles = line_end;
+      line_end = 0;
+    }else
+      cycles += mode_duration(mode);
+  }
+  return limit;
+}
+
+/* Cycles until the PPU next does something nobody has to ask it about:
+ * raising the VBlank interrupt or finishing a frame */
+static int cycles_to_vblank(){
+  int cycles, line;
+  if(gpu->mode == 1)
+    return mode_remaining() + (HEIGHT + 10 - 1 - gpu->line) * SCANLINE_TIME;
+  /* VBlank starts at the end of a horizontal blank, line has already
+   * moved on to the next one by then */
+  line = gpu->line;
+  switch(gpu->mode){
+  case 2:
+    cycles = SCANLINE_TIME - gpu->clock;
+    line++;
+    break;
+  case 3:
+    cycles = SCANLINE_TIME - SCAN_OAM_TIME - gpu->clock;
+    line++;
+    break;
+  default:
+    cycles = mode_remaining();
+    break;
+  }
+  if(line < HEIGHT - 1)
+    cycles += (HEIGHT - 1 - line) * SCANLINE_TIME;
+  return cycles;
+}
+
+/* Cycles until the PPU has to run by itself: the next VBlank or frame
+ * end, or the next rising edge of the STAT interrupt line */
+static int cycles_to_event(){
+  if(!gpu->lcd_display_enable)
+    return FULL_FRAME - gpu->off_clock;
+  int cycles = cycles_to_vblank();
+  if(gpu->stat_enable)
+    cycles = cycles_to_stat(cycles);
+  return cycles;
+}
+
+/* Brings the PPU up to the CPU. The CPU only adds its cycles to
+ * gpu->pending, the PPU runs when its state is looked at or changed, or
+ * when the deadline for its next interrupt or frame is reached. Stepping
+ * to each mode boundary in turn gives exactly the same mode, line and
+ * interrupt timing as stepping after every instruction. */
+void gpu_sync(){
+  if(!gpu->lcd_display_enable){
+    gpu->off_clock += gpu->pending;
+    gpu->pending = 0;
+    while(gpu->off_clock >= FULL_FRAME){
+      gpu->off_clock -= FULL_FRAME;
+      frame_start(pacer_frame());
+    }
+    gpu->deadline = cycles_to_event();
+    return;
+  }
+  while(gpu->pending > 0){
+    int step = mode_remaining();
+    if(step <= 0 || step > gpu->pending)
+      step = gpu->pending;
+    gpu->pending -= step;
+    gpu_step(step);
+  }
+  gpu->deadline = cycles_to_event();
 }
+
+/* Only the interrupt source bits 3-6 can be written */
 void gpu_set_status_register(const u8 value){
-  printf("gpu_set_status_register not finished %X\n", value);
-  gpu->line_compare_enable = value & 0x40 ? 1: 0;
+  gpu_sync();
+  gpu->stat_enable = value & 0x78;
+  stat_update();
+  gpu->deadline = cycles_to_event();
 }
 
 u8 gpu_get_status_register(){
-  return gpu->mode | (gpu->line == gpu->line_compare_enable ? 0x40 : 0);
+  gpu_sync();
+  return 0x80 | gpu->stat_enable |
+    (gpu->line == gpu->line_compare ? 0x04 : 0) | gpu->mode;
 }
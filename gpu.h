@@ -1,7 +1,7 @@
 #ifndef GPU_H
 #define GPU_H
 
-#include <time.h>
+#include <stdatomic.h>
 #include "defs.h"
 #include "types.h"
 
@@ -21,7 +21,8 @@
 #define VIDEO_RAM_END 0x9FFF
 #define TILE_DATA_END 0x97FF
 
-#define FULL_FRAME_TIME_US 16667 /* microseconds */
+#define FRAME_SKIP_AUTO -1 // skip only while running behind real time
+#define FRAME_SKIP_AUTO_MAX 4 // most frames auto mode skips in a row
 
 typedef enum {
     BACKGROUND_PALETTE,
@@ -39,13 +40,107 @@ typedef struct{
     int prio;
 } Sprite;
 
+#define SCANLINE_TIME (SCAN_OAM_TIME + SCAN_VRAM_TIME + HORIZONTAL_BLANK1_TIME)
+#define MAX_LINE_SPRITES 10 // sprites the OAM scan picks per line
+
+typedef enum {
+    GPU_BACKEND_LINE, // fixed mode timing, draws a whole line at once
+    GPU_BACKEND_FIFO // cycle accurate pixel FIFO, see gpu_fifo.c
+} GpuBackend;
+
+/* Formats finished frames can be written out in, see gpu_output.c */
+typedef enum {
+    GPU_OUTPUT_NONE,
+    GPU_OUTPUT_PACKED2, // 2 bit shades, 4 pixels a byte, 5760 bytes a frame
+    GPU_OUTPUT_GRAY8,
+    GPU_OUTPUT_RGB565,
+    GPU_OUTPUT_ARGB8888
+} GpuOutputFormat;
+
+typedef void (*GpuOutputLine)(const u8 *line, u8 *out);
+
+typedef enum {
+    GPU_SCALE_AREA, // average of the source pixels each output pixel covers
+    GPU_SCALE_NEAREST
+} GpuScaleFilter;
+
+typedef struct ScaledOutput ScaledOutput;
+
+/* State of the pixel FIFO backend for the line being drawn */
+typedef struct{
+    u8 bg[8]; // background/window colour indices waiting to be shifted out
+    int bg_head;
+    int bg_count;
+    u8 obj_colour[8]; // sprite pixels lined up with the next 8 bg pixels
+    u8 obj_palette[8];
+    u8 obj_prio[8];
+
+    int fetch_step; // dots into the current tile fetch, negative while idle
+    int fetch_x; // tile column being fetched
+    int fetch_window;
+    u8 *fetch_row;
+
+    int lcd_x; // pixels shifted out to the LCD
+    int discard; // SCX fine scroll pixels still to throw away
+    int stall; // dots left fetching a sprite
+    int window_line; // window's own line counter
+    int window_drawn; // window showed on this line
+
+    int sprites[MAX_LINE_SPRITES]; // picked by the OAM scan, in OAM order
+    int sprite_count;
+    int sprite_fetched; // bit per entry in sprites
+} PixelFifo;
+
+#define FRAME_BUFFERS 3
+
+typedef u8 Frame[HEIGHT][WIDTH];
+
+/* Lock-free triple buffer. Whoever draws owns buffers[back], the
+ * presenter owns buffers[front] and the newest finished frame waits in
+ * ready. Finishing a frame swaps back and ready, taking one swaps ready
+ * and front, so neither side ever waits for the other and the presenter
+ * always gets the newest frame */
+#define FRAME_FRESH 4 // set in ready until the presenter takes the frame
+
+typedef struct{
+    Frame buffers[FRAME_BUFFERS];
+    int shown[FRAME_BUFFERS]; // LCD was on when the frame finished
+    u64 line_hash[FRAME_BUFFERS][HEIGHT]; // lets consumers find changed lines
+    u64 hash[FRAME_BUFFERS]; // whole frame, taken as equal when hashes are
+    int back;
+    _Atomic int ready; // buffer index, plus FRAME_FRESH
+    int front;
+    _Atomic unsigned int completed; // frames finished so far
+} FrameRing;
+
+/* What the debug viewer draws. The UI thread asks for one and the
+ * emulation thread fills it in when the next frame starts, so the viewer
+ * never reads the PPU while it runs */
+typedef struct{
+    u8 tiles[NUM_TILES][8][8];
+    u8 map[0x800]; // both tile maps
+    Sprite sprites[NUM_SPRITES];
+    u16 tile_data_select;
+    int sprite_size;
+    u8 background_palette;
+    u8 object_palette0;
+    u8 object_palette1;
+    u8 background_palette_colours[4];
+    u8 object_palette0_colours[4];
+    u8 object_palette1_colours[4];
+    u32 dirty_tiles[NUM_TILES / 32]; // written since the last copy
+    u32 dirty_map[0x800 / 32];
+} GpuDebugCopy;
+
 typedef struct{
     u8 tiles[NUM_TILES][8][8];
-    u8 screen[HEIGHT] [WIDTH];
     Sprite sprites[NUM_SPRITES];
 
-    u8 frame_buffer[HEIGHT][WIDTH];
+    FrameRing *frames;
     int clock;
+    GpuBackend backend;
+    int mode3_length; // dots the last mode 3 took
+    PixelFifo fifo;
 //scroll registers
     u8 scroll_x;
     u8 scroll_y;
@@ -54,12 +149,28 @@ typedef struct{
 
     int line;
     int line_compare;
-    int line_compare_enable;
+    u8 stat_enable; // STAT interrupt sources, bits 3-6 of the register
+    int stat_line; // the sources ORed, STAT fires when this goes high
     int mode;
     int curscan;
 
     /* Internal to the emulator */
-    struct timespec frame_start_time;
+    int threaded_render; // lines are drawn by the render thread
+    int pending; // CPU cycles the PPU hasn't caught up with yet
+    int deadline; // pending cycles at which the PPU has to catch up
+    int off_clock; // cycles into the current frame length with the LCD off
+    int frame_skip; // frames skipped per drawn frame or FRAME_SKIP_AUTO
+    int skipped_frames; // skipped in a row so far
+    int skip_frame; // current frame is timing only
+    /* VRAM written since the debug viewer last looked, a bit per tile and
+     * per tile map entry, taken with the debug copy */
+    _Atomic u32 dirty_tiles[NUM_TILES / 32];
+    _Atomic u32 dirty_map[0x800 / 32];
+    GpuDebugCopy *_Atomic debug_copy; // asked for, NULL once filled in
+    GpuOutputLine output_line; // converter for finished frames, or NULL
+    int output_pitch;
+    void *output; // caller's buffer finished frames are written to
+    ScaledOutput *scaled; // downscaled gray copy of finished frames, or NULL
 
 /*lcd control register stuff */
     u8 lcd_control_register;
@@ -84,14 +195,14 @@ typedef struct{
 
 } GPU;
 
-extern GPU *gpu;
+extern _Thread_local GPU *gpu;
 //extern int gpu_clock;
 extern void gpu_init();
 extern u8 gpu_get_line();
 extern void gpu_set_line();
 extern u8 gpu_get_line_compare();
 extern void gpu_set_line_compare(u8 value);
-extern void gpu_step(const int op_time);
+extern void gpu_sync();
 extern u8 gpu_get_status_register();
 extern void gpu_set_status_register(const u8 value);
 extern u8 gpu_get_palette(const PaletteType palette_type);
@@ -106,6 +217,34 @@ extern void gpu_set_window_x(const u8 value);
 extern u8 gpu_get_window_x();
 extern void gpu_set_lcd_control_register(const u8 value);
 extern u8 gpu_get_lcd_control_register();
-extern void gpu_update_tile(const u16 address, const u8 value);
+extern void gpu_update_vram(const u16 address, const u8 value);
+extern void gpu_request_debug_copy(GpuDebugCopy *copy);
+extern int gpu_debug_copy_pending();
 extern void gpu_update_sprite(const u16 address, const u8 value);
+extern void gpu_apply_write(GPU *g, u8 *vram, const u16 address, const u8 value);
+extern void gpu_reload();
+extern void gpu_render_scan(GPU *g, const u8 *vram);
+extern void gpu_finish_frame(GPU *g);
+extern int gpu_acquire_frame();
+extern const Frame *gpu_get_frame(const int buffer);
+extern int gpu_frame_shown(const int buffer);
+extern u64 gpu_frame_hash(const int buffer);
+extern const u64 *gpu_frame_line_hashes(const int buffer);
+extern void gpu_set_backend(const GpuBackend backend);
+extern void gpu_set_frame_skip(const int frames);
+extern int gpu_get_frame_skip();
+
+/* gpu_output.c */
+extern int gpu_output_frame_size(const GpuOutputFormat format);
+extern void gpu_convert_frame(const Frame *frame, const GpuOutputFormat format, void *buffer);
+extern void gpu_set_output(const GpuOutputFormat format, void *buffer);
+extern void gpu_output_frame(GPU *g, const Frame *frame);
+extern int gpu_set_scaled_output(const int width, const int height,
+				 const GpuScaleFilter filter, u8 *buffer);
+extern void gpu_output_scaled(GPU *g, const Frame *frame);
+
+/* gpu_fifo.c */
+extern void gpu_fifo_start_frame(GPU *g);
+extern void gpu_fifo_start_line(GPU *g);
+extern int gpu_fifo_run(GPU *g, const u8 *vram, int dots);
 #endif
@@ -0,0 +1,191 @@
+#include <string.h>
+#include "gpu.h"
+#include "types.h"
+
+/* Cycle accurate PPU backend. Mode 3 is run dot by dot through a
+ * background fetcher, a background pixel FIFO and a sprite FIFO, so its
+ * length depends on SCX fine scroll, the window and the sprites on the
+ * line the way it does on hardware, and registers written in the middle of
+ * a line take effect at the right pixel. Selected with gpu_set_backend(),
+ * slower than the line renderer and meant for validation. */
+
+#define FETCH_DOTS 6 // tile number, low byte, high byte, 2 dots each
+#define SPRITE_FETCH_DOTS 6
+
+void gpu_fifo_start_frame(GPU *g){
+  g->fifo.window_line = 0;
+}
+
+/* OAM scan (mode 2) and setup for mode 3 */
+void gpu_fifo_start_line(GPU *g){
+  PixelFifo *f = &g->fifo;
+  int height = g->sprite_size ? 16 : 8;
+
+  f->sprite_count = 0;
+  for(int i = 0; i < NUM_SPRITES && f->sprite_count < MAX_LINE_SPRITES; i++){
+    Sprite *sprite = &g->sprites[i];
+    if(sprite->y <= g->line && sprite->y + height > g->line)
+      f->sprites[f->sprite_count++] = i;
+  }
+  f->sprite_fetched = 0;
+
+  f->bg_head = 0;
+  f->bg_count = 0;
+  memset(f->obj_colour, 0, sizeof(f->obj_colour));
+  f->fetch_step = -FETCH_DOTS; // the first fetch of a line is thrown away
+  f->fetch_x = 0;
+  f->fetch_window = 0;
+  f->fetch_row = NULL;
+  f->lcd_x = 0;
+  f->discard = g->scroll_x & 7;
+  f->stall = 0;
+  f->window_drawn = 0;
+}
+
+static void fetch_tile(GPU *g, const u8 *vram){
+  PixelFifo *f = &g->fifo;
+  unsigned int map, y, tile;
+  if(f->fetch_window){
+    map = g->window_tile_map_display_select + ((f->window_line >> 3) << 5) +
+      (f->fetch_x & 0x1F);
+    y = f->window_line & 7;
+  }else{
+    map = g->background_tile_map_display +
+      ((((g->line + g->scroll_y) & 0xFF) >> 3) << 5) +
+      (((g->scroll_x >> 3) + f->fetch_x) & 0x1F);
+    y = (g->line + g->scroll_y) & 7;
+  }
+  tile = vram[map & 0x1FFF];
+  if(g->tile_data_select == 0x8800 && tile < 128)
+    tile += 256;
+  f->fetch_row = g->tiles[tile][y];
+}
+
+/* Puts a sprite's row into the sprite FIFO. Pixels already there belong to
+ * a sprite with a lower X or OAM index and win */
+static void fetch_sprite(GPU *g, const Sprite *sprite){
+  PixelFifo *f = &g->fifo;
+  int height = g->sprite_size ? 16 : 8;
+  int row = g->line - sprite->y;
+  int tile = sprite->tile;
+  if(sprite->yflip)
+    row = height - 1 - row;
+  if(g->sprite_size)
+    tile = (tile & 0xFE) + (row >> 3);
+  u8 *tilerow = g->tiles[tile][row & 7];
+
+  for(int x = 0; x < 8; x++){
+    int pos = sprite->x + x - f->lcd_x;
+    u8 colour = tilerow[sprite->xflip ? (7 - x) : x];
+    if(pos < 0 || pos >= 8 || !colour || f->obj_colour[pos])
+      continue;
+    f->obj_colour[pos] = colour;
+    f->obj_palette[pos] = sprite->palette;
+    f->obj_prio[pos] = sprite->prio;
+  }
+}
+
+/* Next sprite that starts at or before the current pixel, lowest X first */
+static int next_sprite(GPU *g){
+  PixelFifo *f = &g->fifo;
+  int best = -1;
+  for(int i = 0; i < f->sprite_count; i++){
+    Sprite *sprite = &g->sprites[f->sprites[i]];
+    if(f->sprite_fetched & (1 << i) || sprite->x <= -8 ||
+       sprite->x > f->lcd_x)
+      continue;
+    if(best < 0 || sprite->x < g->sprites[f->sprites[best]].x)
+      best = i;
+  }
+  return best;
+}
+
+static void shift_out(GPU *g, u8 colour){
+  PixelFifo *f = &g->fifo;
+  u8 shade;
+  if(!g->background_display_enable)
+    colour = 0;
+  shade = g->background_palette_colours[colour];
+  if(f->obj_colour[0] && g->sprite_display_enable &&
+     (!f->obj_prio[0] || !colour)){
+    u8 *palette = f->obj_palette[0] ? g->object_palette1_colours :
+      g->object_palette0_colours;
+    shade = palette[f->obj_colour[0]];
+  }
+  if(!g->skip_frame)
+    g->frames->buffers[g->frames->back][g->line][f->lcd_x] =
+      shade;
+
+  memmove(f->obj_colour, f->obj_colour + 1, 7);
+  memmove(f->obj_palette, f->obj_palette + 1, 7);
+  memmove(f->obj_prio, f->obj_prio + 1, 7);
+  f->obj_colour[7] = 0;
+  f->lcd_x++;
+}
+
+/* Runs mode 3 for up to dots dots. Returns the dots used, fewer than asked
+ * for when the line was finished (fifo.lcd_x == WIDTH) */
+int gpu_fifo_run(GPU *g, const u8 *vram, int dots){
+  PixelFifo *f = &g->fifo;
+  int used;
+  for(used = 1; used <= dots; used++){
+    if(f->stall > 0){
+      f->stall--;
+      continue;
+    }
+
+    if(!f->fetch_window && g->window_display_enable &&
+       g->line >= g->window_y && f->lcd_x + 7 >= g->window_x){
+      /* The window replaces whatever background was queued up */
+      f->fetch_window = 1;
+      f->window_drawn = 1;
+      f->bg_count = 0;
+      f->fetch_step = 0;
+      f->fetch_x = 0;
+      f->discard = g->window_x < 7 ? 7 - g->window_x : 0;
+    }
+
+    if(g->sprite_display_enable && f->discard == 0){
+      int i = next_sprite(g);
+      if(i >= 0){
+	/* The background fetch in progress is finished first */
+	int extra = f->fetch_step >= 0 && f->fetch_step < 5 ?
+	  5 - f->fetch_step : 0;
+	f->sprite_fetched |= 1 << i;
+	fetch_sprite(g, &g->sprites[f->sprites[i]]);
+	f->stall = SPRITE_FETCH_DOTS + extra - 1;
+	continue;
+      }
+    }
+
+    if(f->fetch_step < FETCH_DOTS){
+      if(++f->fetch_step == 2)
+	fetch_tile(g, vram);
+    }
+    if(f->fetch_step == FETCH_DOTS && f->bg_count == 0){
+      for(int x = 0; x < 8; x++)
+	f->bg[x] = f->fetch_row[x];
+      f->bg_head = 0;
+      f->bg_count = 8;
+      f->fetch_step = 0;
+      f->fetch_x++;
+    }
+
+    if(f->bg_count > 0){
+      u8 colour = f->bg[f->bg_head];
+      f->bg_head = (f->bg_head + 1) & 7;
+      f->bg_count--;
+      if(f->discard > 0){
+	f->discard--;
+	continue;
+      }
+      shift_out(g, colour);
+      if(f->lcd_x == WIDTH){
+	if(f->window_drawn)
+	  f->window_line++;
+	return used;
+      }
+    }
+  }
+  return dots;
+}
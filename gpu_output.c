@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gpu.h"
+#include "types.h"
+
+/* Finished frames converted to what a consumer asked for, straight into
+ * its own buffer. This is a pass over each frame once it is drawn, not
+ * part of drawing it. The converter is picked once by gpu_set_output().
+ * Each takes 8 to 32 pixels at a time with GCC vector types, the shades
+ * indexing the format's colours with a shuffle, and is built for AVX2
+ * and the baseline like lockstep.c. */
+
+static const u8 shade_gray8[4] = {0xFF, 0x80, 0x40, 0x00};
+
+typedef u8 Shades16 __attribute__((vector_size(16)));
+typedef u8 Shades32 __attribute__((vector_size(32)));
+typedef u16 Rgb565 __attribute__((vector_size(32)));
+typedef u32 Argb8888 __attribute__((vector_size(32)));
+typedef Shades16 UnalignedShades16 __attribute__((aligned(1)));
+typedef Shades32 UnalignedShades32 __attribute__((aligned(1)));
+typedef u8 UnalignedShades8 __attribute__((vector_size(8), aligned(1)));
+
+static const Shades16 colours_gray8 = {
+  0xFF, 0x80, 0x40, 0x00, 0xFF, 0x80, 0x40, 0x00,
+  0xFF, 0x80, 0x40, 0x00, 0xFF, 0x80, 0x40, 0x00,
+};
+static const Rgb565 colours_rgb565 = {
+  0xFFFF, 0x8410, 0x4208, 0x0000, 0xFFFF, 0x8410, 0x4208, 0x0000,
+  0xFFFF, 0x8410, 0x4208, 0x0000, 0xFFFF, 0x8410, 0x4208, 0x0000,
+};
+static const Argb8888 colours_argb8888 = {
+  0xFFFFFFFF, 0xFF808080, 0xFF404040, 0xFF000000,
+  0xFFFFFFFF, 0xFF808080, 0xFF404040, 0xFF000000,
+};
+/* Pixel k of each group of four */
+static const Shades32 packed_pixel[4] = {
+  {0, 4, 8, 12, 16, 20, 24, 28},
+  {1, 5, 9, 13, 17, 21, 25, 29},
+  {2, 6, 10, 14, 18, 22, 26, 30},
+  {3, 7, 11, 15, 19, 23, 27, 31},
+};
+
+/* Four pixels a byte, the leftmost in the top two bits */
+__attribute__((target_clones("avx2", "default")))
+static void line_packed2(const u8 *line, u8 *out){
+  for(int x = 0; x < WIDTH; x += 32){
+    Shades32 shades = *(const UnalignedShades32 *)(line + x) & 3;
+    Shades32 packed = __builtin_shuffle(shades, packed_pixel[0]) << 6 |
+      __builtin_shuffle(shades, packed_pixel[1]) << 4 |
+      __builtin_shuffle(shades, packed_pixel[2]) << 2 |
+      __builtin_shuffle(shades, packed_pixel[3]);
+    memcpy(out + x / 4, &packed, 8);
+  }
+}
+
+__attribute__((target_clones("avx2", "default")))
+static void line_gray8(const u8 *line, u8 *out){
+  for(int x = 0; x < WIDTH; x += 16){
+    Shades16 shades = *(const UnalignedShades16 *)(line + x) & 3;
+    Shades16 pixels = __builtin_shuffle(colours_gray8, shades);
+    memcpy(out + x, &pixels, sizeof(pixels));
+  }
+}
+
+__attribute__((target_clones("avx2", "default")))
+static void line_rgb565(const u8 *line, u8 *out){
+  for(int x = 0; x < WIDTH; x += 16){
+    Rgb565 shades = __builtin_convertvector(*(const UnalignedShades16 *)(line + x),
+					    Rgb565) & 3;
+    Rgb565 pixels = __builtin_shuffle(colours_rgb565, shades);
+    memcpy(out + x * 2, &pixels, sizeof(pixels));
+  }
+}
+
+__attribute__((target_clones("avx2", "default")))
+static void line_argb8888(const u8 *line, u8 *out){
+  for(int x = 0; x < WIDTH; x += 8){
+    Argb8888 shades = __builtin_convertvector(*(const UnalignedShades8 *)(line + x),
+					      Argb8888) & 3;
+    Argb8888 pixels = __builtin_shuffle(colours_argb8888, shades);
+    memcpy(out + x * 4, &pixels, sizeof(pixels));
+  }
+}
+
+static GpuOutputLine output_line(const GpuOutputFormat format){
+  switch(format){
+  case GPU_OUTPUT_PACKED2: return line_packed2;
+  case GPU_OUTPUT_GRAY8: return line_gray8;
+  case GPU_OUTPUT_RGB565: return line_rgb565;
+  case GPU_OUTPUT_ARGB8888: return line_argb8888;
+  default: return NULL;
+  }
+}
+
+/* Bytes in one line of the format */
+static int output_pitch(const GpuOutputFormat format){
+  switch(format){
+  case GPU_OUTPUT_PACKED2: return WIDTH / 4;
+  case GPU_OUTPUT_GRAY8: return WIDTH;
+  case GPU_OUTPUT_RGB565: return WIDTH * 2;
+  case GPU_OUTPUT_ARGB8888: return WIDTH * 4;
+  default: return 0;
+  }
+}
+
+int gpu_output_frame_size(const GpuOutputFormat format){
+  return output_pitch(format) * HEIGHT;
+}
+
+void gpu_convert_frame(const Frame *frame, const GpuOutputFormat format, void *buffer){
+  GpuOutputLine convert = output_line(format);
+  int pitch = output_pitch(format);
+  u8 *out = buffer;
+  if(!convert)
+    return;
+  for(int y = 0; y < HEIGHT; y++)
+    convert((*frame)[y], out + y * pitch);
+}
+
+/* Every frame that finishes is written to buffer in the given format,
+ * GPU_OUTPUT_NONE stops it. With the render thread the frame is written
+ * from that thread, so set this before starting it. */
+void gpu_set_output(const GpuOutputFormat format, void *buffer){
+  gpu->output_line = buffer ? output_line(format) : NULL;
+  gpu->output_pitch = output_pitch(format);
+  gpu->output = buffer;
+}
+
+void gpu_output_frame(GPU *g, const Frame *frame){
+  u8 *out = g->output;
+  for(int y = 0; y < HEIGHT; y++)
+    g->output_line((*frame)[y], out + y * g->output_pitch);
+}
+
+/* Downscaled 8 bit gray, for consumers that only want a small picture.
+ * Source rows and columns of each output pixel are worked out once when
+ * the size is set. */
+struct ScaledOutput{
+  GpuScaleFilter filter;
+  int width;
+  int height;
+  u8 *buffer;
+  int col_start[WIDTH + 1]; // output column x covers source columns
+                            // col_start[x] to col_start[x + 1] - 1
+  int row_start[HEIGHT + 1];
+  int nearest_col[WIDTH];
+  int nearest_row[HEIGHT];
+};
+
+int gpu_set_scaled_output(const int width, const int height,
+			  const GpuScaleFilter filter, u8 *buffer){
+  ScaledOutput *s = gpu->scaled;
+  if(!buffer){
+    free(s);
+    gpu->scaled = NULL;
+    return 0;
+  }
+  if(width < 1 || width > WIDTH || height < 1 || height > HEIGHT){
+    fprintf(stderr, "Scaled output has to be between 1x1 and %dx%d\n",
+	    WIDTH, HEIGHT);
+    return -1;
+  }
+  if(!s)
+    s = malloc(sizeof(ScaledOutput));
+  s->filter = filter;
+  s->width = width;
+  s->height = height;
+  s->buffer = buffer;
+  for(int x = 0; x <= width; x++)
+    s->col_start[x] = x * WIDTH / width;
+  for(int y = 0; y <= height; y++)
+    s->row_start[y] = y * HEIGHT / height;
+  // centre of each output pixel
+  for(int x = 0; x < width; x++)
+    s->nearest_col[x] = (2 * x + 1) * WIDTH / (2 * width);
+  for(int y = 0; y < height; y++)
+    s->nearest_row[y] = (2 * y + 1) * HEIGHT / (2 * height);
+  gpu->scaled = s;
+  return 0;
+}
+
+/* A source pixel picked for each output pixel, which would only be a
+ * gather in vectors */
+static void scale_nearest(const ScaledOutput *s, const Frame *frame){
+  u8 *out = s->buffer;
+  for(int y = 0; y < s->height; y++){
+    const u8 *line = (*frame)[s->nearest_row[y]];
+    for(int x = 0; x < s->width; x++)
+      *out++ = shade_gray8[line[s->nearest_col[x]] & 3];
+  }
+}
+
+/* The source rows are added up column by column sixteen at a time in
+ * vectors. Spans of columns vary in width, so adding them across each
+ * one is left as a loop */
+typedef u16 ColumnSums __attribute__((vector_size(32)));
+
+__attribute__((target_clones("avx2", "default")))
+static void scale_area(const ScaledOutput *s, const Frame *frame){
+  u8 *out = s->buffer;
+  for(int y = 0; y < s->height; y++){
+    ColumnSums sums[WIDTH / 16] = {0}; // at most 144 rows of 255
+    int rows = s->row_start[y + 1] - s->row_start[y];
+    for(int sy = s->row_start[y]; sy < s->row_start[y + 1]; sy++){
+      const u8 *line = (*frame)[sy];
+      for(int x = 0; x < WIDTH; x += 16){
+	Shades16 shades = *(const UnalignedShades16 *)(line + x) & 3;
+	sums[x / 16] += __builtin_convertvector(__builtin_shuffle(colours_gray8, shades),
+						ColumnSums);
+      }
+    }
+    const u16 *column = (const u16 *)sums;
+    for(int x = 0; x < s->width; x++){
+      unsigned int sum = 0;
+      int cols = s->col_start[x + 1] - s->col_start[x];
+      for(int sx = s->col_start[x]; sx < s->col_start[x + 1]; sx++)
+	sum += column[sx];
+      *out++ = (sum + rows * cols / 2) / (rows * cols);
+    }
+  }
+}
+
+void gpu_output_scaled(GPU *g, const Frame *frame){
+  if(g->scaled->filter == GPU_SCALE_NEAREST)
+    scale_nearest(g->scaled, frame);
+  else
+    scale_area(g->scaled, frame);
+}
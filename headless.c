@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gameboy.h"
+#include "savestate.h"
+#include "rewind.h"
+
+/* Frontend without a window for servers, benchmarks and batch jobs. Runs
+ * a fixed number of frames, takes the buttons from a script and converts
+ * each frame into one buffer (and records them to disk with -r). Links
+ * no SDL. */
+
+#define MAX_INPUT_EVENTS 4096
+
+typedef struct {
+    unsigned long frame; // buttons held from this frame on
+    u8 buttons;
+} InputEvent;
+
+static InputEvent events[MAX_INPUT_EVENTS];
+static int event_count;
+
+static void usage(const char *name){
+    printf("Usage %s [-f] [-n frames] [-i input] [-o packed2|gray8|rgb565|argb8888]\n"
+           "          [-p exact|uncapped|speed] [-r file.raw|file.y4m|file.rle]\n"
+           "          [-l state] [-w state] [-R frames] <gameboy rom>\n", name);
+    printf("  -f  use the cycle accurate pixel FIFO PPU\n");
+    printf("  -n  frames to run, 600 if not given\n");
+    printf("  -i  button script, lines of \"frame buttons\" with buttons like\n"
+           "      a+start or - for none, held until the next line\n");
+    printf("  -o  pixel format each finished frame is converted to\n");
+    printf("  -p  run at real speed, as fast as possible (the default) or "
+           "speed times real speed\n");
+    printf("  -r  record every frame, format picked by the extension\n");
+    printf("  -l  start from a save state instead of from boot\n");
+    printf("  -w  write a save state after the last frame\n");
+    printf("  -R  keep rewind history, report its cost and step back this many\n"
+           "      frames after the last one\n");
+}
+
+static int button_mask(char *names){
+    static const char *button_names[8] = {"a", "b", "select", "start",
+                                          "right", "left", "up", "down"};
+    int mask = 0;
+    if(strcmp(names, "-") == 0)
+        return 0;
+    for(char *name = strtok(names, "+"); name; name = strtok(NULL, "+")){
+        int i;
+        for(i = 0; i < 8 && strcmp(name, button_names[i]) != 0; i++)
+            ;
+        if(i == 8)
+            return -1;
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+static int load_input(const char *filename){
+    FILE *file = fopen(filename, "r");
+    char line[256], names[128];
+    unsigned long frame;
+    int number = 0;
+    if(!file){
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), file)){
+        number++;
+        if(line[0] == '#' || line[0] == '\n')
+            continue;
+        int mask = -1;
+        if(sscanf(line, "%lu %127s", &frame, names) == 2)
+            mask = button_mask(names);
+        if(mask < 0 || event_count == MAX_INPUT_EVENTS ||
+           (event_count && frame < events[event_count - 1].frame)){
+            fprintf(stderr, "%s:%d: bad input line\n", filename, number);
+            fclose(file);
+            return -1;
+        }
+        events[event_count].frame = frame;
+        events[event_count].buttons = mask;
+        event_count++;
+    }
+    fclose(file);
+    return 0;
+}
+
+/* Runs the frames and reports on them. With rw it then steps back
+ * rewind_frames through the history */
+static void run(const unsigned long frames, Rewind *rw, const long rewind_frames){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* A frame at a time so the buttons change on frame boundaries */
+    int next_event = 0;
+    while(pacer->total_frames < frames){
+        while(next_event < event_count &&
+              events[next_event].frame <= pacer->total_frames)
+            joypad_set_buttons(events[next_event++].buttons);
+        unsigned long before = pacer->total_frames;
+        pacer_set_frame_limit(before + 1);
+        cpu_resume();
+        cpu_run();
+        if(pacer->total_frames == before)
+            break; // the CPU gave up
+        if(rw)
+            rewind_frame(rw);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    recorder_stop();
+    int buffer = gpu_acquire_frame();
+    if(buffer >= 0)
+        printf("last frame hash %016llx\n", gpu_frame_hash(buffer));
+    pacer_report();
+    if(rw){
+        RewindStats stats;
+        double run_ms = (end.tv_sec - start.tv_sec) * 1e3 +
+            (end.tv_nsec - start.tv_nsec) / 1e6;
+        rewind_stats(rw, &stats);
+        printf("rewind: %lu frames of history in %zu bytes, %.0f KB a minute, "
+               "%.1f ms taking %lu states (%.2f%% of the run)\n",
+               stats.frames, stats.bytes, stats.frames ?
+               (double)stats.bytes / stats.frames * 3600 / 1024 : 0,
+               stats.encode_ms, stats.states, 100 * stats.encode_ms / run_ms);
+        long stepped = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while(stepped < rewind_frames && rewind_step_back(rw) == 0)
+            stepped++;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        buffer = gpu_acquire_frame();
+        if(stepped && buffer >= 0)
+            printf("stepped back %ld frames in %.1f ms, frame hash %016llx\n",
+                   stepped, (end.tv_sec - start.tv_sec) * 1e3 +
+                   (end.tv_nsec - start.tv_nsec) / 1e6, gpu_frame_hash(buffer));
+    }
+}
+
+int main(int argc,char **argv){
+    char *save_name = "lgb.sav";
+    unsigned long frames = 600;
+    char *input_name = NULL;
+    char *record_name = NULL;
+    char *load_name = NULL;
+    char *state_name = NULL;
+    long rewind_frames = -1;
+    GpuOutputFormat format = GPU_OUTPUT_PACKED2;
+    GpuBackend backend = GPU_BACKEND_LINE;
+    PacerMode pacer_mode = PACER_UNCAPPED;
+    double speed = 1.0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "fn:i:o:p:r:l:w:R:")) != -1){
+        switch(opt){
+        case 'f':
+            backend = GPU_BACKEND_FIFO;
+            break;
+        case 'n':
+            frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            input_name = optarg;
+            break;
+        case 'o':
+            if(strcmp(optarg, "packed2") == 0)
+                format = GPU_OUTPUT_PACKED2;
+            else if(strcmp(optarg, "gray8") == 0)
+                format = GPU_OUTPUT_GRAY8;
+            else if(strcmp(optarg, "rgb565") == 0)
+                format = GPU_OUTPUT_RGB565;
+            else if(strcmp(optarg, "argb8888") == 0)
+                format = GPU_OUTPUT_ARGB8888;
+            else{
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'p':
+            if(strcmp(optarg, "exact") == 0)
+                pacer_mode = PACER_EXACT;
+            else if(strcmp(optarg, "uncapped") == 0)
+                pacer_mode = PACER_UNCAPPED;
+            else if((speed = atof(optarg)) > 0)
+                pacer_mode = PACER_MULTIPLIER;
+            else{
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            record_name = optarg;
+            break;
+        case 'l':
+            load_name = optarg;
+            break;
+        case 'w':
+            state_name = optarg;
+            break;
+        case 'R':
+            rewind_frames = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1){
+        usage(argv[0]);
+        return 1;
+    }
+    if(input_name && load_input(input_name) != 0)
+        return 1;
+
+    Gameboy *gb = gameboy_create();
+    gpu_set_backend(backend);
+    pacer_set_mode(pacer_mode, speed);
+    u8 *output = malloc(gpu_output_frame_size(format));
+    gpu_set_output(format, output);
+
+    int status = 0;
+    int loaded = load_rom(argv[optind], save_name) == 0;
+    Rewind *rw = NULL;
+    if(!loaded){
+        fprintf(stderr,"File not found\n");
+        status = 1;
+    }else if(load_name && savestate_load_file(load_name) != 0)
+        status = 1;
+    else if(record_name && recorder_start(record_name,
+                                          recorder_format_for(record_name),
+                                          RECORD_BLOCK) != 0)
+        status = 1;
+    else{
+        if(rewind_frames >= 0)
+            rw = rewind_create(REWIND_INTERVAL, REWIND_BUDGET);
+        run(frames, rw, rewind_frames);
+        if(state_name && savestate_save_file(state_name) != 0)
+            status = 1;
+    }
+    /* Every way out after the instance exists comes through here */
+    recorder_stop();
+    rewind_destroy(rw);
+    if(loaded)
+        mem_save_ram(save_name);
+    gameboy_destroy(gb);
+    free(output);
+    return status;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "joypad.h"
+
+_Thread_local Joypad *joypad;
+
+void joypad_init(){
+    joypad = malloc(sizeof(Joypad));
+    for(int i = 0; i < 2; i++)
+        joypad->rows[i] = 0x0F;
+    joypad->column = 0;
+}
+
+void joypad_press(const u8 buttons){
+    joypad->rows[0] &= ~buttons & 0x0F;
+    joypad->rows[1] &= ~(buttons >> 4) & 0x0F;
+}
+
+void joypad_release(const u8 buttons){
+    joypad->rows[0] |= buttons & 0x0F;
+    joypad->rows[1] |= buttons >> 4;
+}
+
+/* Replaces the whole state, for frontends that poll all buttons at once */
+void joypad_set_buttons(const u8 buttons){
+    joypad->rows[0] = ~buttons & 0x0F;
+    joypad->rows[1] = ~(buttons >> 4) & 0x0F;
+}
+
+u8 joypad_read(){
+    switch(joypad->column){
+    case 0x10:
+        return joypad->rows[0];
+    case 0x20:
+        return joypad->rows[1];
+    default:
+        fprintf(stderr,"Key not recognised %d\n",joypad->column);
+        return 0;
+    }
+}
+
+void joypad_write(const u8 value){
+    joypad->column = value & 0x30;
+}
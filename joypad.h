@@ -0,0 +1,35 @@
+#ifndef JOYPAD_H
+#define JOYPAD_H
+
+#include "types.h"
+
+/* Buttons as a mask, the low nibble is the action row of the joypad
+ * register and the high nibble the direction row */
+typedef enum {
+    JOYPAD_A = 0x01,
+    JOYPAD_B = 0x02,
+    JOYPAD_SELECT = 0x04,
+    JOYPAD_START = 0x08,
+    JOYPAD_RIGHT = 0x10,
+    JOYPAD_LEFT = 0x20,
+    JOYPAD_UP = 0x40,
+    JOYPAD_DOWN = 0x80
+} JoypadButton;
+
+/* rows are active low and can be written from a frontend thread while
+ * the emulated CPU reads them */
+typedef struct {
+    _Atomic u8 rows[2];
+    u8 column;
+} Joypad;
+
+void joypad_init();
+void joypad_press(const u8 buttons);
+void joypad_release(const u8 buttons);
+void joypad_set_buttons(const u8 buttons);
+u8 joypad_read();
+void joypad_write(const u8 value);
+
+extern _Thread_local Joypad *joypad;
+
+#endif
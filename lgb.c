@@ -0,0 +1,353 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef LGB_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+#include "lgb.h"
+#include "gameboy.h"
+#include "pool.h"
+#include "lockstep.h"
+#include "savestate.h"
+
+struct Lgb{
+    Gameboy *gb;
+    int buffer; // frame buffer last handed out, -1 before the first frame
+    int node; // NUMA node its state was last moved to, -1 never
+};
+
+/* Every call binds its instance to the calling thread first, so
+ * instances can move between threads and different ones run at once.
+ * Always rebound, a freed instance's address may come back for a new one */
+static void bind(Lgb *lgb){
+    gameboy_bind(lgb->gb);
+}
+
+Lgb *lgb_create(void){
+    Lgb *lgb = malloc(sizeof(Lgb));
+    lgb->gb = gameboy_create();
+    lgb->buffer = -1;
+    lgb->node = -1;
+    pacer_set_mode(PACER_UNCAPPED, 1.0);
+    return lgb;
+}
+
+void lgb_destroy(Lgb *lgb){
+    if(!lgb)
+	return;
+    gameboy_destroy(lgb->gb);
+    free(lgb);
+}
+
+int lgb_load_rom_from_memory(Lgb *lgb, const unsigned char *rom, size_t size){
+    bind(lgb);
+    return load_rom_from_memory(rom, size);
+}
+
+int lgb_run_frame(Lgb *lgb){
+    bind(lgb);
+    unsigned long before = pacer->total_frames;
+    pacer_set_frame_limit(before + 1);
+    cpu_resume();
+    cpu_run();
+    return pacer->total_frames == before ? -1 : 0;
+}
+
+void lgb_set_buttons(Lgb *lgb, unsigned int buttons){
+    bind(lgb);
+    joypad_set_buttons(buttons);
+}
+
+const unsigned char *lgb_get_framebuffer(Lgb *lgb){
+    bind(lgb);
+    int buffer = gpu_acquire_frame();
+    if(buffer >= 0)
+	lgb->buffer = buffer;
+    if(lgb->buffer < 0)
+	lgb->buffer = gpu->frames->front; // nothing drawn yet, all white
+    return (const unsigned char *)gpu_get_frame(lgb->buffer);
+}
+
+size_t lgb_save_state(Lgb *lgb, void *buffer, size_t size){
+    bind(lgb);
+    return savestate_save(buffer, size);
+}
+
+int lgb_load_state(Lgb *lgb, const void *buffer, size_t size){
+    bind(lgb);
+    return savestate_load(buffer, size);
+}
+
+/* Each part on its own cache line, the cartridge RAM last */
+struct LgbSnapshot{
+    _Alignas(64) Cpu cpu;
+    _Alignas(64) Memory memory;
+    _Alignas(64) GPU gpu;
+    _Alignas(64) Timer timer;
+    Joypad joypad;
+    u16 checksum; // the cartridge header's, with the sizes below it tells games apart
+    int rom_banks;
+    int eram_size;
+    _Alignas(64) u8 eram[];
+};
+
+static u16 rom_checksum(){
+    return memory->rom ? memory->rom[0x14E] << 8 | memory->rom[0x14F] : 0;
+}
+
+static int same_game(const LgbSnapshot *snapshot){
+    return snapshot->rom_banks == memory->rom_banks &&
+	snapshot->eram_size == memory->eram_size &&
+	snapshot->checksum == rom_checksum();
+}
+
+/* The pixel FIFO's fetch_row points into the tiles of its own GPU. Where
+ * frames go and how they are drawn stay the destination's own */
+static void copy_gpu(GPU *to, const GPU *from){
+    FrameRing *frames = to->frames;
+    GpuOutputLine output_line = to->output_line;
+    int output_pitch = to->output_pitch;
+    void *output = to->output;
+    ScaledOutput *scaled = to->scaled;
+    int frame_skip = to->frame_skip;
+    int threaded_render = to->threaded_render;
+    memcpy(to, from, sizeof(GPU));
+    if(from->fifo.fetch_row)
+	to->fifo.fetch_row = (u8 *)to->tiles +
+	    (from->fifo.fetch_row - (const u8 *)from->tiles);
+    to->frames = frames;
+    to->output_line = output_line;
+    to->output_pitch = output_pitch;
+    to->output = output;
+    to->scaled = scaled;
+    to->frame_skip = frame_skip;
+    to->threaded_render = threaded_render;
+}
+
+LgbSnapshot *lgb_snapshot_create(Lgb *lgb){
+    bind(lgb);
+    size_t size = sizeof(LgbSnapshot) + memory->eram_size;
+    LgbSnapshot *snapshot = aligned_alloc(_Alignof(LgbSnapshot),
+					  (size + 63) & ~(size_t)63);
+    if(!snapshot)
+	return NULL;
+    memset(snapshot, 0, sizeof(LgbSnapshot));
+    snapshot->checksum = rom_checksum();
+    snapshot->rom_banks = memory->rom_banks;
+    snapshot->eram_size = memory->eram_size;
+    lgb_clone_into(snapshot, lgb);
+    return snapshot;
+}
+
+void lgb_snapshot_destroy(LgbSnapshot *snapshot){
+    free(snapshot);
+}
+
+int lgb_clone_into(LgbSnapshot *dst, Lgb *src){
+    bind(src);
+    if(!same_game(dst))
+	return -1;
+    dst->cpu = *cpu;
+    memcpy(&dst->memory, memory, sizeof(Memory));
+    dst->memory.rom = NULL;
+    dst->memory.eram = NULL;
+    copy_gpu(&dst->gpu, gpu);
+    dst->timer = *timer;
+    memcpy(&dst->joypad, joypad, sizeof(Joypad));
+    memcpy(dst->eram, memory->eram, memory->eram_size);
+    return 0;
+}
+
+int lgb_restore(Lgb *lgb, const LgbSnapshot *snapshot){
+    bind(lgb);
+    if(!same_game(snapshot))
+	return -1;
+    u8 *rom = memory->rom;
+    u8 *eram = memory->eram;
+    *cpu = snapshot->cpu;
+    memcpy(memory, &snapshot->memory, sizeof(Memory));
+    memory->rom = rom;
+    memory->eram = eram;
+    copy_gpu(gpu, &snapshot->gpu);
+    *timer = snapshot->timer;
+    memcpy(joypad, &snapshot->joypad, sizeof(Joypad));
+    memcpy(memory->eram, snapshot->eram, memory->eram_size);
+    mem_mark_dirty();
+    return 0;
+}
+
+/* One batch is stepped at a time, on a pool made by the first one */
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static Pool *batch_pool;
+static int batch_threads;
+static unsigned int batch_options;
+static unsigned int *batch_progress; // frames each instance has run this step
+static size_t batch_size;
+
+typedef struct{
+    Lgb **instances;
+    const unsigned int *actions;
+    unsigned int frames;
+    const LgbBatchOutput *output;
+} Batch;
+
+#ifdef LGB_NUMA
+static void move_pages_to(const void *start, const size_t size, int node){
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t end = (uintptr_t)start + size;
+    void *pages[64];
+    int nodes[64];
+    int status[64];
+    int count = 0;
+    if(!start)
+	return;
+    for(uintptr_t p = (uintptr_t)start & ~(page - 1); p < end; p += page){
+	pages[count] = (void *)p;
+	nodes[count] = node;
+	if(++count == 64 || p + page >= end){
+	    numa_move_pages(0, count, pages, nodes, status, MPOL_MF_MOVE);
+	    count = 0;
+	}
+    }
+}
+
+/* Moves the instance's state next to the worker that runs it */
+static void place(Lgb *lgb, const int node){
+    move_pages_to(cpu, sizeof(Cpu), node);
+    move_pages_to(memory, sizeof(Memory), node);
+    move_pages_to(memory->rom, 0x8000 << memory->rom_banks, node);
+    move_pages_to(memory->eram, memory->eram_size, node);
+    move_pages_to(gpu, sizeof(GPU), node);
+    move_pages_to(gpu->frames, sizeof(FrameRing), node);
+    lgb->node = node;
+}
+#endif
+
+/* One frame of one instance, so an idle worker can take over the rest of
+ * an instance that is slow this step */
+static int batch_task(void *arg, size_t i, int node){
+    Batch *batch = arg;
+    Lgb *lgb = batch->instances[i];
+    const LgbBatchOutput *out = batch->output;
+    int done = 0;
+    bind(lgb);
+#ifdef LGB_NUMA
+    if(node >= 0 && node != lgb->node)
+	place(lgb, node);
+#else
+    (void)node;
+#endif
+    if(batch_progress[i] == 0)
+	joypad_set_buttons(batch->actions ? batch->actions[i] : 0);
+    if(batch_progress[i] < batch->frames){
+	done = lgb_run_frame(lgb) != 0;
+	if(!done && ++batch_progress[i] < batch->frames)
+	    return 1;
+    }
+    if(out->done)
+	out->done[i] = done;
+    if(out->framebuffers)
+	memcpy(out->framebuffers + i * LGB_WIDTH * LGB_HEIGHT,
+	       lgb_get_framebuffer(lgb), LGB_WIDTH * LGB_HEIGHT);
+    if(out->ram)
+	for(size_t r = 0; r < out->ram_count; r++)
+	    out->ram[i * out->ram_count + r] = mem_peek(out->ram_addresses[r]);
+    return 0;
+}
+
+void lgb_batch_step(Lgb **instances, size_t n, const unsigned int *actions,
+		    unsigned int frames, const LgbBatchOutput *output){
+    static const LgbBatchOutput no_output;
+    Batch batch = {instances, actions, frames, output ? output : &no_output};
+    pthread_mutex_lock(&batch_lock);
+    if(!batch_pool)
+	batch_pool = pool_create(batch_threads, batch_options);
+    if(n > batch_size){
+	batch_progress = realloc(batch_progress, sizeof(unsigned int) * n);
+	batch_size = n;
+    }
+    memset(batch_progress, 0, sizeof(unsigned int) * n);
+    pool_run(batch_pool, batch_task, &batch, n);
+    pthread_mutex_unlock(&batch_lock);
+}
+
+/* The next step makes a new pool with the settings */
+static void batch_configure(const int threads, const unsigned int options){
+    pthread_mutex_lock(&batch_lock);
+    batch_threads = threads;
+    batch_options = options;
+    pool_destroy(batch_pool);
+    batch_pool = NULL;
+    pthread_mutex_unlock(&batch_lock);
+}
+
+void lgb_batch_set_threads(int threads){
+    batch_configure(threads, batch_options);
+}
+
+void lgb_batch_set_options(unsigned int options){
+    unsigned int pool_options = 0;
+    if(options & LGB_BATCH_PIN)
+	pool_options |= POOL_PIN;
+    if(options & LGB_BATCH_NUMA)
+	pool_options |= POOL_NUMA;
+    batch_configure(batch_threads, pool_options);
+}
+
+int lgb_batch_stats(LgbWorkerStats *stats, int max){
+    pthread_mutex_lock(&batch_lock);
+    int threads = batch_pool ? pool_threads(batch_pool) : 0;
+    PoolWorkerStats workers[threads > 0 ? threads : 1];
+    if(batch_pool)
+	pool_stats(batch_pool, workers, threads);
+    for(int i = 0; i < threads && i < max; i++){
+	stats[i].cpu = workers[i].cpu;
+	stats[i].node = workers[i].node;
+	stats[i].frames = workers[i].tasks;
+	stats[i].steals = workers[i].steals;
+	stats[i].utilization = workers[i].utilization;
+    }
+    pthread_mutex_unlock(&batch_lock);
+    return threads;
+}
+
+void lgb_batch_reset_stats(void){
+    pthread_mutex_lock(&batch_lock);
+    if(batch_pool)
+	pool_reset_stats(batch_pool);
+    pthread_mutex_unlock(&batch_lock);
+}
+
+int lgb_lockstep_run_frame(Lgb **instances, size_t n, LgbLockstepStats *stats){
+    Gameboy *lanes[LOCKSTEP_LANES];
+    unsigned long before[LOCKSTEP_LANES];
+    Lockstep ls;
+    int result = 0;
+    for(size_t first = 0; first < n; first += LOCKSTEP_LANES){
+	int count = n - first < LOCKSTEP_LANES ? n - first : LOCKSTEP_LANES;
+	for(int l = 0; l < count; l++){
+	    bind(instances[first + l]);
+	    lanes[l] = instances[first + l]->gb;
+	    before[l] = pacer->total_frames;
+	    pacer_set_frame_limit(before[l] + 1);
+	    cpu_resume();
+	}
+	lockstep_init(&ls, lanes, count);
+	lockstep_run(&ls);
+	for(int l = 0; l < count; l++){
+	    bind(instances[first + l]);
+	    if(pacer->total_frames == before[l])
+		result = -1;
+	}
+	if(stats){
+	    stats->vector_steps += ls.vector_steps;
+	    stats->vector_instructions += ls.vector_lanes;
+	    stats->scalar_instructions += ls.scalar_lanes;
+	}
+    }
+    return result;
+}
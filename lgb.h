@@ -0,0 +1,145 @@
+#ifndef LGB_H
+#define LGB_H
+
+#include <stddef.h>
+
+/* Embedding API for the emulator core. Link liblgb.a or liblgb.so and
+ * drive it a frame at a time, no window or SDL is involved.
+ *
+ * Every Lgb is a separate Game Boy. Different ones can be used from
+ * different threads at the same time, one Lgb must only be used by one
+ * thread at a time. */
+
+#ifdef __GNUC__
+#define LGB_API __attribute__((visibility("default")))
+#else
+#define LGB_API
+#endif
+
+#define LGB_WIDTH 160
+#define LGB_HEIGHT 144
+
+/* Buttons for lgb_set_buttons, ORed together */
+#define LGB_BUTTON_A 0x01
+#define LGB_BUTTON_B 0x02
+#define LGB_BUTTON_SELECT 0x04
+#define LGB_BUTTON_START 0x08
+#define LGB_BUTTON_RIGHT 0x10
+#define LGB_BUTTON_LEFT 0x20
+#define LGB_BUTTON_UP 0x40
+#define LGB_BUTTON_DOWN 0x80
+
+typedef struct Lgb Lgb;
+
+LGB_API Lgb *lgb_create(void);
+LGB_API void lgb_destroy(Lgb *lgb);
+
+/* The image is copied, returns 0 on success. An instance runs one game,
+ * loading another into it fails */
+LGB_API int lgb_load_rom_from_memory(Lgb *lgb, const unsigned char *rom,
+				     size_t size);
+
+/* Runs until the next frame has finished, returns 0 or -1 if the CPU
+ * stopped without finishing one */
+LGB_API int lgb_run_frame(Lgb *lgb);
+
+/* Buttons held from now on, replacing the ones held before */
+LGB_API void lgb_set_buttons(Lgb *lgb, unsigned int buttons);
+
+/* LGB_WIDTH * LGB_HEIGHT shades, 0 white to 3 black, of the newest
+ * finished frame. Stays valid and unchanged until the next call */
+LGB_API const unsigned char *lgb_get_framebuffer(Lgb *lgb);
+
+/* Writes the machine state to buffer and returns its size. With a NULL
+ * or too small buffer nothing is written and the size needed is
+ * returned. The format is the versioned one in savestate.h, the same
+ * lgb-headless -l and -w use, and loads into any build running the
+ * same game */
+LGB_API size_t lgb_save_state(Lgb *lgb, void *buffer, size_t size);
+/* Returns 0, or -1 if the state is damaged or for another game */
+LGB_API int lgb_load_state(Lgb *lgb, const void *buffer, size_t size);
+
+/* A copy of an instance's machine state in one block of memory made up
+ * front, for tree search and rollback. The ROM isn't copied, a snapshot
+ * restores into any instance running the same game. The frame buffer
+ * isn't part of it, lgb_get_framebuffer shows the old one until the next
+ * frame */
+typedef struct LgbSnapshot LgbSnapshot;
+
+/* Makes a snapshot the right size for the game lgb has loaded, with the
+ * state it is in now */
+LGB_API LgbSnapshot *lgb_snapshot_create(Lgb *lgb);
+LGB_API void lgb_snapshot_destroy(LgbSnapshot *snapshot);
+/* Copy src's state into dst, or dst's state into lgb. Neither allocates.
+ * Return 0, or -1 if the snapshot was made for another game */
+LGB_API int lgb_clone_into(LgbSnapshot *dst, Lgb *src);
+LGB_API int lgb_restore(Lgb *lgb, const LgbSnapshot *snapshot);
+
+/* Where lgb_batch_step puts its results, a NULL pointer skips that part.
+ * Instance i's results are at index i of each array */
+typedef struct{
+    /* n * LGB_WIDTH * LGB_HEIGHT shades, the frame each instance ended on */
+    unsigned char *framebuffers;
+    /* n flags, set where the CPU stopped without finishing a frame */
+    unsigned char *done;
+    /* n * ram_count bytes read from ram_addresses after the step, for
+     * scores, lives and the like. Reading them has no side effects, the
+     * I/O registers other than IF and IE read 0 */
+    const unsigned short *ram_addresses;
+    size_t ram_count;
+    unsigned char *ram;
+} LgbBatchOutput;
+
+/* Runs every instance for frames frames with actions[i] (LGB_BUTTON_*
+ * masks) held and returns when all of them are through. An instance that
+ * is done stops there. Each frame is a task for a pool of work stealing
+ * threads, so threads that finish early take over frames of the slow
+ * instances. The instances must all be different and not in use
+ * elsewhere during the call */
+LGB_API void lgb_batch_step(Lgb **instances, size_t n,
+			    const unsigned int *actions, unsigned int frames,
+			    const LgbBatchOutput *output);
+/* Threads lgb_batch_step uses, including the calling one. 0, the
+ * default, is one per online CPU. Must not be called during a step */
+LGB_API void lgb_batch_set_threads(int threads);
+
+/* Options for lgb_batch_set_options, ORed together */
+#define LGB_BATCH_PIN 0x01 // pin every batch thread but the caller to a CPU
+/* Pins, and moves each instance's state to the NUMA node of the thread
+ * that runs it. Needs a build with NUMA=1, ignored otherwise */
+#define LGB_BATCH_NUMA 0x02
+
+/* Replaces the options, none by default. Must not be called during a step */
+LGB_API void lgb_batch_set_options(unsigned int options);
+
+/* A batch thread's counters since the pool was made or the last reset */
+typedef struct{
+    int cpu; // pinned to, -1 if not
+    int node; // NUMA node, -1 if not NUMA aware
+    unsigned long frames; // instance frames run
+    unsigned long steals; // of those, taken over from another thread
+    double utilization; // time spent running frames over time in steps
+} LgbWorkerStats;
+
+/* Fills in up to max threads' counters, the caller's is first, and
+ * returns how many threads there are, 0 before the first step */
+LGB_API int lgb_batch_stats(LgbWorkerStats *stats, int max);
+LGB_API void lgb_batch_reset_stats(void);
+
+/* Experimental. Counters for lgb_lockstep_run_frame, added to by every call */
+typedef struct{
+    unsigned long vector_steps; // opcodes run for several instances at once
+    unsigned long vector_instructions; // instance instructions those covered
+    unsigned long scalar_instructions; // instance instructions run alone
+} LgbLockstepStats;
+
+/* Runs a frame of every instance like lgb_run_frame, on the calling
+ * thread, with instances of the same game that are on the same code
+ * running it together with vector instructions. Pays off when they are
+ * in step, e.g. started from one state with few different inputs.
+ * Returns 0, or -1 if any stopped without finishing a frame. stats may
+ * be NULL */
+LGB_API int lgb_lockstep_run_frame(Lgb **instances, size_t n,
+				   LgbLockstepStats *stats);
+
+#endif
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lockstep.h"
+
+typedef signed char LaneS8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int LaneS32 __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+
+#define REG_H 4
+#define REG_L 5
+#define REG_F 6
+#define REG_A 7
+
+/* Opcodes that only touch registers and PC, which lanes can run together.
+ * Each one has to do exactly what cpu_step does with it. */
+static int vectorised(const u8 op){
+    if(op >= 0x40 && op < 0x80) // LD r, r
+	return (op & 7) != 6 && ((op >> 3) & 7) != 6;
+    if(op >= 0x80 && op < 0xC0) // ALU A, r
+	return (op & 7) != 6;
+    switch(op){
+    case 0x00: // NOP
+    case 0x03: case 0x13: case 0x23: // INC rr
+    case 0x0B: case 0x1B: case 0x2B: // DEC rr
+    case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+    case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+    case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+    case 0x07: case 0x0F: case 0x17: case 0x1F: // rotate A
+    case 0x09: case 0x19: case 0x29: // ADD HL, rr
+    case 0x2F: case 0x37: case 0x3F: // CPL, SCF, CCF
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+    case 0xC3: // JP
+    case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+    case 0xE6: case 0xEE: case 0xF6: case 0xFE: // ALU A, d8
+	return 1;
+    }
+    return 0;
+}
+
+/* Bytes after the opcode */
+static int operands(const u8 op){
+    if(op == 0xC3)
+	return 2;
+    if((op < 0x40 && (op & 7) == 6) || (op >= 0xC0 && (op & 7) == 6) ||
+       op == 0x18 || op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38)
+	return 1;
+    return 0;
+}
+
+/* Between lane masks of bytes and of PCs. Macros, the wide vectors
+ * don't pass through calls the same way with and without AVX */
+#define narrow(mask) ((LaneU8)__builtin_convertvector((mask), LaneS8))
+#define widen(mask) ((LaneU32)__builtin_convertvector((LaneS8)(mask), LaneS32))
+
+static inline LaneU8 zero_flag(const LaneU8 x){
+    return (LaneU8)(x == 0) & 0x80;
+}
+
+static inline LaneU8 add(const LaneU8 a, const LaneU8 b, const LaneU8 carry,
+			 LaneU8 *f){
+    LaneU16 sum = __builtin_convertvector(a, LaneU16) +
+	__builtin_convertvector(b, LaneU16) +
+	__builtin_convertvector(carry, LaneU16);
+    LaneU8 result = __builtin_convertvector(sum, LaneU8);
+    *f = zero_flag(result) | (((a & 0xF) + (b & 0xF) + carry) << 1 & 0x20) |
+	__builtin_convertvector(sum >> 8, LaneU8) << 4;
+    return result;
+}
+
+static inline LaneU8 sub(const LaneU8 a, const LaneU8 b, const LaneU8 carry,
+			 LaneU8 *f){
+    LaneU16 diff = __builtin_convertvector(a, LaneU16) -
+	__builtin_convertvector(b, LaneU16) -
+	__builtin_convertvector(carry, LaneU16);
+    LaneU8 result = __builtin_convertvector(diff, LaneU8);
+    /* a borrow leaves the high bits set */
+    *f = zero_flag(result) | 0x40 |
+	(((a & 0xF) - (b & 0xF) - carry) & 0x10) << 1 |
+	(__builtin_convertvector(diff >> 8, LaneU8) & 1) << 4;
+    return result;
+}
+
+/* The eight ALU operations of 0x80-0xBF and 0xC6-0xFE on A and b */
+static inline void alu(LaneU8 *r, const int operation, const LaneU8 b){
+    LaneU8 a = r[REG_A];
+    LaneU8 carry = r[REG_F] >> 4 & 1;
+    LaneU8 none = carry ^ carry;
+    switch(operation){
+    case 0: r[REG_A] = add(a, b, none, &r[REG_F]); break;
+    case 1: r[REG_A] = add(a, b, carry, &r[REG_F]); break;
+    case 2: r[REG_A] = sub(a, b, none, &r[REG_F]); break;
+    case 3: r[REG_A] = sub(a, b, carry, &r[REG_F]); break;
+    case 4: r[REG_A] = a & b; r[REG_F] = zero_flag(a & b) | 0x20; break;
+    case 5: r[REG_A] = a ^ b; r[REG_F] = zero_flag(a ^ b); break;
+    case 6: r[REG_A] = a | b; r[REG_F] = zero_flag(a | b); break;
+    case 7: sub(a, b, none, &r[REG_F]); break; // CP
+    }
+}
+
+/* Runs op for the lanes in mask, imm and imm_high are the bytes after it
+ * in each lane. Built for AVX2 and plain x86-64, picked at load time */
+__attribute__((target_clones("avx2", "default")))
+static void execute(Lockstep *ls, const u8 op, const LaneU8 imm,
+		    const LaneU8 imm_high, const LaneU8 mask, LaneU8 *cycles){
+    LaneU8 r[8];
+    LaneU8 f;
+    LaneU32 pc = (ls->PC + 1 + operands(op)) & 0xFFFF;
+    memcpy(r, ls->reg, sizeof(r));
+    f = r[REG_F];
+    *cycles = (imm ^ imm) + (u8)(4 + 4 * operands(op));
+
+    if(op >= 0x40 && op < 0x80){
+	r[(op >> 3) & 7] = r[op & 7];
+    }else if(op >= 0x80 && op < 0xC0){
+	alu(r, (op >> 3) & 7, r[op & 7]);
+    }else if(op >= 0xC0 && (op & 7) == 6){
+	alu(r, (op >> 3) & 7, imm);
+    }else if(op < 0x40 && (op & 7) == 4){ // INC r
+	LaneU8 x = r[(op >> 3) & 7];
+	r[(op >> 3) & 7] = x + 1;
+	r[REG_F] = (f & 0x10) | zero_flag(x + 1) | ((LaneU8)((x & 0xF) == 0xF) & 0x20);
+    }else if(op < 0x40 && (op & 7) == 5){ // DEC r
+	LaneU8 x = r[(op >> 3) & 7];
+	r[(op >> 3) & 7] = x - 1;
+	r[REG_F] = (f & 0x10) | 0x40 | ((LaneU8)((x & 0xF) == 0) & 0x20) |
+	    ((LaneU8)(x == 1) & 0x80);
+    }else if(op < 0x40 && (op & 7) == 6){ // LD r, d8
+	r[(op >> 3) & 7] = imm;
+    }else if(op < 0x40 && (op & 0xF) == 3){ // INC rr
+	int high = (op >> 4) * 2;
+	r[high + 1] += 1;
+	r[high] += (LaneU8)(r[high + 1] == 0) & 1;
+	*cycles += 4;
+    }else if(op < 0x40 && (op & 0xF) == 0xB){ // DEC rr
+	int high = (op >> 4) * 2;
+	r[high] -= (LaneU8)(r[high + 1] == 0) & 1;
+	r[high + 1] -= 1;
+	*cycles += 4;
+    }else if(op < 0x40 && (op & 0xF) == 9){ // ADD HL, rr
+	int high = (op >> 4) * 2;
+	LaneU32 hl = __builtin_convertvector(r[REG_H], LaneU32) << 8 |
+	    __builtin_convertvector(r[REG_L], LaneU32);
+	LaneU32 rr = __builtin_convertvector(r[high], LaneU32) << 8 |
+	    __builtin_convertvector(r[high + 1], LaneU32);
+	LaneU32 sum = hl + rr;
+	r[REG_H] = __builtin_convertvector(sum >> 8, LaneU8);
+	r[REG_L] = __builtin_convertvector(sum, LaneU8);
+	r[REG_F] = (f & 0x80) |
+	    (narrow((hl & 0x7FF) + (rr & 0x7FF) > 0x7FF) & 0x20) |
+	    (narrow(sum > 0xFFFF) & 0x10);
+	*cycles += 4;
+    }else{
+	LaneU8 a = r[REG_A];
+	LaneU8 taken;
+	LaneU32 offset = (LaneU32)__builtin_convertvector((LaneS8)imm, LaneS32);
+	switch(op){
+	case 0x07: r[REG_A] = a << 1 | a >> 7; r[REG_F] = (a >> 7) << 4; break;
+	case 0x0F: r[REG_A] = a >> 1 | a << 7; r[REG_F] = (a & 1) << 4; break;
+	case 0x17: r[REG_A] = a << 1 | (f >> 4 & 1); r[REG_F] = (a >> 7) << 4; break;
+	case 0x1F: r[REG_A] = a >> 1 | (f & 0x10) << 3; r[REG_F] = (a & 1) << 4; break;
+	case 0x2F: r[REG_A] = ~a; r[REG_F] = f | 0x60; break;
+	case 0x37: r[REG_F] = (f & 0x80) | 0x10; break;
+	case 0x3F: r[REG_F] = (f & 0x80) | ((f & 0x10) ^ 0x10); break;
+	case 0xC3:
+	    pc = __builtin_convertvector(imm_high, LaneU32) << 8 |
+		__builtin_convertvector(imm, LaneU32);
+	    *cycles += 4;
+	    break;
+	case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+	    switch(op){
+	    case 0x20: taken = (LaneU8)((f & 0x80) == 0); break;
+	    case 0x28: taken = (LaneU8)((f & 0x80) != 0); break;
+	    case 0x30: taken = (LaneU8)((f & 0x10) == 0); break;
+	    case 0x38: taken = (LaneU8)((f & 0x10) != 0); break;
+	    default: taken = ~(f ^ f); break;
+	    }
+	    /* JR Z doesn't wrap PC round like the others */
+	    LaneU32 target = op == 0x28 ?
+		((ls->PC + 1) & 0xFFFF) + offset + 1 : (pc + offset) & 0xFFFF;
+	    if(op == 0x28)
+		pc = ((ls->PC + 1) & 0xFFFF) + 1;
+	    pc = (target & widen(taken)) | (pc & ~widen(taken));
+	    *cycles += taken & 4;
+	    break;
+	}
+    }
+
+    for(int i = 0; i < 8; i++)
+	ls->reg[i] = (r[i] & mask) | (ls->reg[i] & ~mask);
+    ls->PC = (pc & widen(mask)) | (ls->PC & ~widen(mask));
+}
+
+/* Between a lane's registers and its Cpu, the lane has to be bound */
+static void sync_out(const Lockstep *ls, const int lane){
+    cpu->B = ls->reg[0][lane];
+    cpu->C = ls->reg[1][lane];
+    cpu->D = ls->reg[2][lane];
+    cpu->E = ls->reg[3][lane];
+    cpu->H = ls->reg[4][lane];
+    cpu->L = ls->reg[5][lane];
+    cpu->F = ls->reg[REG_F][lane];
+    cpu->A = ls->reg[REG_A][lane];
+    cpu->PC = ls->PC[lane];
+}
+
+static void sync_in(Lockstep *ls, const int lane){
+    ls->reg[0][lane] = cpu->B;
+    ls->reg[1][lane] = cpu->C;
+    ls->reg[2][lane] = cpu->D;
+    ls->reg[3][lane] = cpu->E;
+    ls->reg[4][lane] = cpu->H;
+    ls->reg[5][lane] = cpu->L;
+    ls->reg[REG_F][lane] = cpu->F;
+    ls->reg[REG_A][lane] = cpu->A;
+    ls->PC[lane] = cpu->PC;
+}
+
+/* Takes the lanes' registers from their Cpus, call it again whenever
+ * something else has run them */
+void lockstep_init(Lockstep *ls, Gameboy **lanes, const int count){
+    Gameboy *previous = gameboy;
+    memset(ls, 0, sizeof(Lockstep));
+    ls->count = count < LOCKSTEP_LANES ? count : LOCKSTEP_LANES;
+    for(int l = 0; l < ls->count; l++){
+	ls->lanes[l] = lanes[l];
+	gameboy_bind(lanes[l]);
+	sync_in(ls, l);
+    }
+    gameboy_bind(previous);
+}
+
+static void run_group(Lockstep *ls, const u8 op, const LaneU8 group){
+    LaneU8 imm = group ^ group;
+    LaneU8 imm_high = imm;
+    LaneU8 cycles;
+    int bytes = operands(op);
+    int conditional = op == 0x20 || op == 0x28 || op == 0x30 || op == 0x38;
+    for(int l = 0; bytes && l < ls->count; l++){
+	if(!group[l])
+	    continue;
+	gameboy_bind(ls->lanes[l]);
+	imm[l] = get_mem(ls->PC[l] + 1);
+	if(bytes == 2)
+	    imm_high[l] = get_mem(ls->PC[l] + 2);
+    }
+    execute(ls, op, imm, imm_high, group, &cycles);
+    for(int l = 0; l < ls->count; l++){
+	if(!group[l])
+	    continue;
+	/* an interrupt only needs PC, the rest stays in the lanes */
+	gameboy_bind(ls->lanes[l]);
+	cpu->PC = ls->PC[l];
+	cpu->cycle_counter = cycles[l];
+	cpu->jump_taken = conditional && cycles[l] == 12;
+	cpu_account(cycles[l]);
+	ls->PC[l] = cpu->PC;
+    }
+    ls->vector_steps++;
+}
+
+/* Every lane runs an instruction a round until cpu_exit has been called
+ * on all of them, like cpu_run does for one */
+void lockstep_run(Lockstep *ls){
+    Gameboy *previous = gameboy;
+    if(cpu_load_opcodes() != 0)
+	return;
+    for(;;){
+	LaneU8 op = {0};
+	LaneU8 joinable = {0}; // can be part of a group this round
+	LaneU8 running = {0};
+	LaneU8 group = {0};
+	int size = 0;
+	u8 group_op = 0;
+	for(int l = 0; l < ls->count; l++){
+	    gameboy_bind(ls->lanes[l]);
+	    if(cpu->cpu_exit_loop)
+		continue;
+	    running[l] = 0xFF;
+	    if(cpu->cpu_halt || cpu->PC_skip)
+		continue;
+	    op[l] = get_mem(ls->PC[l]);
+	    joinable[l] = vectorised(op[l]) ? 0xFF : 0;
+	}
+	/* The first lane that has company on its PC and opcode leads */
+	for(int l = 0; l < ls->count && size < 2; l++){
+	    if(!joinable[l])
+		continue;
+	    group = joinable & (LaneU8)(op == op[l]) & narrow(ls->PC == ls->PC[l]);
+	    size = 0;
+	    for(int i = 0; i < ls->count; i++)
+		size += group[i] != 0;
+	    group_op = op[l];
+	    joinable &= ~group; // don't try the same group again
+	}
+	if(size >= 2){
+	    run_group(ls, group_op, group);
+	    ls->vector_lanes += size;
+	}else{
+	    group ^= group;
+	}
+	int alone = 0;
+	for(int l = 0; l < ls->count; l++){
+	    if(!running[l] || group[l])
+		continue;
+	    gameboy_bind(ls->lanes[l]);
+	    sync_out(ls, l);
+	    cpu_run_instruction();
+	    sync_in(ls, l);
+	    alone++;
+	}
+	ls->scalar_lanes += alone;
+	if(!alone && !size)
+	    break;
+    }
+    for(int l = 0; l < ls->count; l++){
+	gameboy_bind(ls->lanes[l]);
+	sync_out(ls, l);
+    }
+    gameboy_bind(previous);
+}
@@ -0,0 +1,37 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "types.h"
+#include "gameboy.h"
+
+/* Experimental interpreter for many copies of one game. Up to
+ * LOCKSTEP_LANES instances run side by side an instruction at a time with
+ * their registers kept as structure of arrays. Lanes on the same PC and
+ * opcode run it together with vector instructions (AVX2 where the CPU
+ * has it) when it only touches registers, every other lane steps through
+ * the normal cpu_step on its own. Timer, PPU and interrupts stay per
+ * instance. */
+
+#define LOCKSTEP_LANES 16 // 8 or 16
+
+typedef u8 LaneU8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef u16 LaneU16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef u32 LaneU32 __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+
+typedef struct{
+    /* B C D E H L F A, the opcodes' register order with F where (HL) goes */
+    LaneU8 reg[8];
+    LaneU32 PC;
+
+    Gameboy *lanes[LOCKSTEP_LANES];
+    int count;
+
+    unsigned long vector_steps; // opcodes run for a group of lanes at once
+    unsigned long vector_lanes; // lane instructions those covered
+    unsigned long scalar_lanes; // lane instructions run one at a time
+} Lockstep;
+
+void lockstep_init(Lockstep *ls, Gameboy **lanes, const int count);
+void lockstep_run(Lockstep *ls);
+
+#endif
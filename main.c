@@ -1,34 +1,177 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include "cpu.h"
-#include "mem.h"
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "gameboy.h"
 #include "display.h"
-#include "gpu.h"
-#include "timer.h"
+
+static void usage(const char *name){
+    printf("Usage %s [-t] [-f] [-d] [-s frames|auto] [-p exact|uncapped|speed] "
+           "[-b frames] [-z scale|scale2x|lcdscale]\n"
+           "          [-r file.raw|file.y4m|file.rle [-k]] <gameboy rom>\n", name);
+    printf("  -t  draw scanlines on a separate render thread\n");
+    printf("  -f  use the cycle accurate pixel FIFO PPU\n");
+    printf("  -d  open a viewer for the tiles, tile maps, OAM and palettes\n");
+    printf("  -s  draw one frame then skip this many, or skip when behind\n");
+    printf("  -p  run at real speed, as fast as possible or speed times "
+           "real speed\n");
+    printf("  -b  benchmark: run this many frames uncapped and exit\n");
+    printf("  -z  scale the window up 1-6 times, with Scale2x or an LCD grid\n");
+    printf("  -r  record the frames shown, format picked by the extension\n");
+    printf("  -k  keep every frame, slow down rather than drop any\n");
+}
+
+static _Atomic int emulating;
+
+/* The emulator runs on its own thread so SDL, the compositor and event
+ * handling on the main thread never hold it up */
+static void *emulation_main(void *arg){
+    gameboy_bind(arg); // the main thread keeps it bound to present and poll
+    while(!display.exit){
+        cpu_run();
+        if(pacer->frame_limit && pacer->total_frames >= pacer->frame_limit)
+            break;
+        if(cpu_take_step_request())
+            cpu_run_once(); // paused, only single steps from the UI
+        else
+            usleep(1000);
+    }
+    atomic_store(&emulating, 0);
+    return NULL;
+}
+
+/* For leaving early once the game is loaded, what a normal exit does
+ * without the reports */
+static void shut_down(Gameboy *gb, char *save_name){
+    render_thread_stop();
+    recorder_stop();
+    mem_save_ram(save_name);
+    gameboy_destroy(gb);
+}
 
 int main(int argc,char **argv){
   char *save_name = "lgb.sav";
+  int threaded_render = 0;
+  int debug_view = 0;
+  int frame_skip = 0;
+  PacerMode pacer_mode = PACER_EXACT;
+  double speed = 1.0;
+  GpuBackend backend = GPU_BACKEND_LINE;
+  unsigned long bench_frames = 0;
+  DisplayScaler scaler = SCALER_NEAREST;
+  int scale = 1;
+  char *record_name = NULL;
+  RecordPolicy record_policy = RECORD_DROP;
+  int opt;
 
-    if(argc != 2){
-        printf("Usage %s <gameboy rom>\n", argv[0]);
+    while((opt = getopt(argc, argv, "tfds:p:b:z:r:k")) != -1){
+        switch(opt){
+        case 't':
+            threaded_render = 1;
+            break;
+        case 'f':
+            backend = GPU_BACKEND_FIFO;
+            break;
+        case 'd':
+            debug_view = 1;
+            break;
+        case 'b':
+            bench_frames = strtoul(optarg, NULL, 10);
+            pacer_mode = PACER_UNCAPPED;
+            break;
+        case 's':
+            if(strcmp(optarg, "auto") == 0)
+                frame_skip = FRAME_SKIP_AUTO;
+            else
+                frame_skip = atoi(optarg);
+            break;
+        case 'p':
+            if(strcmp(optarg, "exact") == 0)
+                pacer_mode = PACER_EXACT;
+            else if(strcmp(optarg, "uncapped") == 0)
+                pacer_mode = PACER_UNCAPPED;
+            else if((speed = atof(optarg)) > 0)
+                pacer_mode = PACER_MULTIPLIER;
+            else{
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'z':
+            if(strcmp(optarg, "scale2x") == 0){
+                scaler = SCALER_SCALE2X;
+                scale = 2;
+            }else if(strncmp(optarg, "lcd", 3) == 0){
+                scaler = SCALER_LCD;
+                scale = atoi(optarg + 3);
+            }else
+                scale = atoi(optarg);
+            break;
+        case 'r':
+            record_name = optarg;
+            break;
+        case 'k':
+            record_policy = RECORD_BLOCK;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1){
+        usage(argv[0]);
         return 1;
     }
 
-    cpu_init();
-    mem_init();
-    gpu_init();
-    display_init();
-    timer_init();
+    display_init(); // SDL_Quit runs at exit from here on
+    if(display_set_scaler(scaler, scale) != 0)
+        return 1;
+    Gameboy *gb = gameboy_create();
+    if(debug_view)
+        display_open_debug();
+    gpu_set_backend(backend);
+    gpu_set_frame_skip(frame_skip);
+    pacer_set_mode(pacer_mode, speed);
+    pacer_set_frame_limit(bench_frames);
 
-    if(load_rom(argv[1], save_name) == 0){
-        while (!display.exit){
-            cpu_run();
+    if(load_rom(argv[optind], save_name) == 0){
+        if(threaded_render)
+            render_thread_start();
+        if(record_name && recorder_start(record_name,
+                                         recorder_format_for(record_name),
+                                         record_policy) != 0){
+            shut_down(gb, save_name);
+            return 1;
+        }
+        pthread_t emulation;
+        atomic_store(&emulating, 1);
+        if(pthread_create(&emulation, NULL, emulation_main, gb) != 0){
+            fprintf(stderr,"Unable to start the emulation thread\n");
+            shut_down(gb, save_name);
+            return 1;
+        }
+        while(!display.exit && atomic_load(&emulating)){
             display_get_input();
+            if(!display_present())
+                SDL_Delay(1);
+            display_debug_update();
         }
+        cpu_exit();
+        display.exit = 1;
+        pthread_join(emulation, NULL);
+        render_thread_stop();
+        recorder_stop();
+        if(bench_frames)
+            printf("%s PPU: ", backend == GPU_BACKEND_FIFO ? "pixel FIFO" :
+                   "line");
+        pacer_report();
     }else{
         fprintf(stderr,"File not found\n");
         return 1;
     }
     mem_save_ram(save_name);
+    gameboy_destroy(gb);
     return 0;
 }
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "types.h"
@@ -7,8 +9,8 @@
 #include "defs.h"
 #include "bios.h"
 #include "gpu.h"
-#include "display.h"
-#include "timer.h"
+#include "joypad.h"
+#include "timer-new.h"
 
 #define SYSTEM_JOYPAD_TYPE_REGISTER 0xFF00
 #define SERIAL_TRANSFER_DATA 0xFF01
@@ -59,7 +61,7 @@
 #define DISABLE_BOOT_ROM 0xFF50
 #define INTERRUPT_ENABLE 0xFFFF
 
-Memory *memory;
+_Thread_local Memory *memory;
 
 void mbc_init()
 {
@@ -79,28 +81,39 @@ void mem_init(){
     memory->debug = 0;
     memory->memory_bank_controller = 0;
     memory->eram_size = 0;
+    memory->rom = NULL;
+    memory->eram = NULL;
+    mem_mark_dirty();
     mbc_init();
 }
 
-int load_rom(char* gb_rom_name, char *save_file_name){
-    int tmp;
-    u8 cartheader[0x150];
-    char game_title[0x10];
+/* For when the memories were replaced without going through set_mem */
+void mem_mark_dirty(){
+    memory->dirty_vram = ~0u;
+    memory->dirty_wram = ~0u;
+    memset(memory->dirty_eram, 0xFF, sizeof(memory->dirty_eram));
+}
+
+/* Sets the cartridge up from a ROM image already in memory, the image is
+ * copied. Only once, the CPU and PPU would still be running the last game */
+int load_rom_from_memory(const u8 *data, const size_t size){
+    char game_title[0x11];
     int cart_type;
-    FILE *gb_rom = fopen(gb_rom_name, "r");
-    FILE *save_file = NULL;
-    if(!gb_rom)
+    if(memory->rom){
+      fprintf(stderr, "A game is already loaded, it takes a new instance\n");
+      return -1;
+    }
+    if(size < 0x150){
+      fprintf(stderr, "ROM is too small to have a header\n");
       return -1;
+    }
 
-    for(int i = 0; i < 0x150 && (tmp = getc(gb_rom)) != EOF; i++)
-	cartheader[i] = tmp;
-    for(int i = 0; i < 0x10; i++)
-	game_title[i] = cartheader[0x0134 + i];
+    memcpy(game_title, &data[0x0134], 0x10);
+    game_title[0x10] = 0;
     printf("Welcome to %s\n", game_title);
-    fseek(gb_rom, 0, SEEK_SET);
-    cart_type = cartheader[0x0147];
-    memory->rom_banks = cartheader[0x0148];
-    memory->ram_banks = cartheader[0x0149];
+    cart_type = data[0x0147];
+    memory->rom_banks = data[0x0148];
+    memory->ram_banks = data[0x0149];
     printf("cart_type %X rom_banks %d ram banks %d\n",
 	   cart_type, memory->rom_banks, memory->ram_banks);
 
@@ -165,6 +178,30 @@ int load_rom(char* gb_rom_name, char *save_file_name){
       break;
     }
 
+    size_t rom_size = 0x8000 << memory->rom_banks;
+    memory->rom = calloc(rom_size, sizeof(u8));
+    memcpy(memory->rom, data, size < rom_size ? size : rom_size);
+    return 0;
+}
+
+int load_rom(char* gb_rom_name, char *save_file_name){
+    int tmp;
+    FILE *gb_rom = fopen(gb_rom_name, "r");
+    FILE *save_file = NULL;
+    if(!gb_rom)
+      return -1;
+
+    fseek(gb_rom, 0, SEEK_END);
+    long size = ftell(gb_rom);
+    fseek(gb_rom, 0, SEEK_SET);
+    u8 *data = malloc(size > 0 ? size : 1);
+    size = fread(data, 1, size > 0 ? size : 0, gb_rom);
+    fclose(gb_rom);
+    tmp = load_rom_from_memory(data, size);
+    free(data);
+    if(tmp != 0)
+      return tmp;
+
     /* If the game has battery backed RAM it needs to be loaded in */
     if(memory->memory_bank_controllers.ram_battery &&
        access(save_file_name, F_OK) != -1)
@@ -175,13 +212,6 @@ int load_rom(char* gb_rom_name, char *save_file_name){
 	  memory->eram[i] = tmp;
 	fclose(save_file);
       }
-
-    memory->rom = malloc(sizeof(u8) * (0x8000 << memory->rom_banks));
-    for(int i = 0; i < 0x8000 << memory->rom_banks &&
-	  (tmp = getc(gb_rom)) != EOF; i++)
-      memory->rom[i] = tmp;
-    fclose(gb_rom);
-
     return 0;
 }
 
@@ -252,7 +282,7 @@ u8 get_mem(u16 address){
             if(address < 0xFF80){
                 switch(address){
                 case 0xFF00://get keys being pressed
-                    return display_get_key();
+                    return joypad_read();
 		case SERIAL_TRANSFER_DATA:
 		case SIO_CONTROL:
 		  return 0; // TODO
@@ -262,6 +292,7 @@ u8 get_mem(u16 address){
 		case TIMER_CONTROL:
 		    return timer_read_byte(address);
                 case INTERRUPT_FLAG:
+                    gpu_sync(); // VBlank may be due
                     return memory->interrupt_flags;
 
 		case SOUND_MODE_1_SWEEP_REGISTER:
@@ -337,6 +368,32 @@ u8 get_mem(u16 address){
     }
 }
 
+/* What the CPU would read from ROM and the RAMs, without syncing the PPU,
+ * switching out the boot ROM or complaining. The registers other than IF
+ * and IE read 0 */
+u8 mem_peek(const u16 address){
+    if(address < 0x4000)
+	return memory->rom ? memory->rom[address] : 0;
+    if(address < 0x8000)
+	return memory->rom ? memory->rom[memory->rom_offset + (address & 0x3FFF)] : 0;
+    if(address < 0xA000)
+	return memory->vram[address & 0x1FFF];
+    if(address < 0xC000)
+	return memory->memory_bank_controllers.ram_on && memory->eram ?
+	    memory->eram[memory->ram_offset + (address & 0x1FFF)] : 0;
+    if(address < 0xFE00)
+	return memory->wram[address & 0x1FFF];
+    if(address < 0xFEA0)
+	return memory->oam[address & 0xFF];
+    if(address == INTERRUPT_FLAG)
+	return memory->interrupt_flags;
+    if(address == INTERRUPT_ENABLE)
+	return memory->interrupt_enable;
+    if(address >= 0xFF80)
+	return memory->zram[address & 0x7F];
+    return 0;
+}
+
 u16 get_mem_16(u16 address){
     return (get_mem(address) <<8) + get_mem(address+1);
 }
@@ -432,22 +489,26 @@ void set_mem(u16 address, u8 value){
         return;
         //VRAM 2KB
     case 0x8000: case 0x9000:
-        memory->vram[address & 0x1FFF] = value;
-        if(address <= TILE_DATA_END)
-            gpu_update_tile(address, value);
+        gpu_update_vram(address, value); // also stores it once the PPU caught up
+        memory->dirty_vram |= 1u << ((address & 0x1FFF) >> 8);
         return;
         //Swtichable RAM 2KB
     case 0xA000: case 0xB000:
-      if(memory->memory_bank_controllers.ram_on)
-	memory->eram[memory->ram_offset + (address & 0x1FFF)] = value;
+      if(memory->memory_bank_controllers.ram_on){
+	u32 offset = memory->ram_offset + (address & 0x1FFF);
+	memory->eram[offset] = value;
+	memory->dirty_eram[offset >> 13] |= 1u << ((offset >> 8) & 31);
+      }
       return;
         //Internal RAM 2KB
     case 0xC000: case 0xD000:
         memory->wram[address & 0x1FFF] = value;
+        memory->dirty_wram |= 1u << ((address & 0x1FFF) >> 8);
         return;
         //Echo internal RAM 0xE000->0xFE00
     case 0xE000:
         memory->wram[address & 0x1FFF] = value;
+        memory->dirty_wram |= 1u << ((address & 0x1FFF) >> 8);
         return;
     case 0xF000:
         switch(address & 0x0F00){
@@ -455,18 +516,19 @@ void set_mem(u16 address, u8 value){
         case 0x500: case 0x600: case 0x700: case 0x800: case 0x900:
         case 0xA00: case 0xB00: case 0xC00: case 0xD00:
             memory->wram[address & 0x1FFF] = value;
+            memory->dirty_wram |= 1u << ((address & 0x1FFF) >> 8);
             return;
         case 0xE00:
             if(address < 0xFEA0){
-                memory->oam[address & 0xFF] = value;
                 gpu_update_sprite(address, value);
+                memory->oam[address & 0xFF] = value;
             }
 	    return;
         case 0xF00:
             if(address < 0xFF80){
                 switch(address){
                 case SYSTEM_JOYPAD_TYPE_REGISTER://keys
-                    display_set_key(value);
+                    joypad_write(value);
                     return;
 		case SERIAL_TRANSFER_DATA:
 		case SIO_CONTROL:
@@ -477,6 +539,7 @@ void set_mem(u16 address, u8 value){
 		case TIMER_CONTROL:
 		    return timer_write_byte(address, value);
                 case INTERRUPT_FLAG:
+                    gpu_sync();
                     memory->interrupt_flags = value;
                     return;
 
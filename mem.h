@@ -7,11 +7,14 @@
 
 void mem_init();
 int load_rom(char *gb_rom_name, char *save_file_name);
+int load_rom_from_memory(const u8 *data, const size_t size);
 u8 get_mem(u16 address);
+u8 mem_peek(const u16 address);
 u16 get_mem_16(u16 address);
 void set_mem(u16 address,u8 value);
 void set_mem_16(u16 address,u16 value);
 void mem_save_ram(char *save_file_name);
+void mem_mark_dirty();
 
 typedef struct{
     unsigned int rom_bank;
@@ -39,8 +42,12 @@ typedef struct{
     MemoryBankController memory_bank_controllers;
     u32 debug;
     int eram_size;
+    /* 256 byte pages written since rewind.c last took a state, a bit each */
+    u32 dirty_vram;
+    u32 dirty_wram;
+    u32 dirty_eram[4];
 }Memory;
 
-extern Memory *memory;
+extern _Thread_local Memory *memory;
 
 #endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "pacer.h"
+#include "cpu.h"
+
+_Thread_local Pacer *pacer;
+
+static long timespec_diff_ns(const struct timespec *a, const struct timespec *b){
+    return (a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
+
+static void timespec_add_ns(struct timespec *t, long ns){
+    t->tv_nsec += ns;
+    while(t->tv_nsec >= 1000000000L){
+	t->tv_nsec -= 1000000000L;
+	t->tv_sec++;
+    }
+}
+
+static long frame_ns(){
+    if(pacer->mode == PACER_MULTIPLIER)
+	return (long)(PACER_FRAME_NS / pacer->speed);
+    return PACER_FRAME_NS;
+}
+
+void pacer_init(){
+    pacer = malloc(sizeof(Pacer));
+    pacer->mode = PACER_EXACT;
+    pacer->speed = 1.0;
+    atomic_init(&pacer->fast_forward, 0);
+    pacer->late_ns = 0;
+    pacer->resyncs = 0;
+    pacer->window_frames = 0;
+    pacer->measured_speed = 0;
+    pacer->total_frames = 0;
+    pacer->frame_limit = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pacer->start);
+    pacer->window_start = pacer->start;
+    pacer->deadline = pacer->start;
+    timespec_add_ns(&pacer->deadline, frame_ns());
+}
+
+void pacer_set_mode(const PacerMode mode, const double speed){
+    pacer->mode = mode;
+    pacer->speed = speed > 0 ? speed : 1.0;
+    /* Start counting from now so a mode change doesn't cause a burst */
+    clock_gettime(CLOCK_MONOTONIC, &pacer->deadline);
+    timespec_add_ns(&pacer->deadline, frame_ns());
+}
+
+PacerMode pacer_get_mode(){
+    return pacer->mode;
+}
+
+/* Called once per emulated frame. Sleeps until the frame's deadline and
+ * moves the deadline on by one frame, so sleeping too long or too short
+ * on one frame is made up on the next instead of adding up. Returns how
+ * late the frame was in nanoseconds, 0 if it was on time. */
+long pacer_frame(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pacer->total_frames++;
+    pacer->window_frames++;
+    if(pacer->frame_limit && pacer->total_frames >= pacer->frame_limit)
+	cpu_exit();
+    long window = timespec_diff_ns(&now, &pacer->window_start);
+    if(window >= PACER_REPORT_NS){
+	pacer->measured_speed = (double)pacer->window_frames *
+	    PACER_FRAME_NS / window;
+	pacer->window_frames = 0;
+	pacer->window_start = now;
+    }
+
+    if(pacer->mode == PACER_UNCAPPED ||
+       atomic_load_explicit(&pacer->fast_forward, memory_order_relaxed)){
+	/* Keep the deadline a frame ahead so letting go of fast forward
+	 * doesn't look like we fell behind */
+	pacer->deadline = now;
+	timespec_add_ns(&pacer->deadline, frame_ns());
+	pacer->late_ns = 0;
+	return 0;
+    }
+
+    long remaining = timespec_diff_ns(&pacer->deadline, &now);
+    if(remaining > 0){
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			      &pacer->deadline, NULL) == EINTR)
+	    ;
+	pacer->late_ns = 0;
+    }else{
+	pacer->late_ns = -remaining;
+    }
+    if(pacer->late_ns > PACER_MAX_LAG_NS){
+	/* Too far behind (stopped in a debugger, host was busy), don't
+	 * try to run flat out until we have caught up */
+	pacer->deadline = now;
+	pacer->resyncs++;
+    }
+    timespec_add_ns(&pacer->deadline, frame_ns());
+    return pacer->late_ns;
+}
+
+/* Runs uncapped while on, without touching the mode. Safe to call from
+ * another thread */
+void pacer_fast_forward(const int on){
+    atomic_store_explicit(&pacer->fast_forward, on, memory_order_relaxed);
+}
+
+/* Used by benchmarks, stops the CPU after the given number of frames */
+void pacer_set_frame_limit(const unsigned long frames){
+    pacer->frame_limit = frames;
+}
+
+/* Emulated time over wall time for the last full second, 1.0 is real
+ * Game Boy speed */
+double pacer_get_speed(){
+    return pacer->measured_speed;
+}
+
+void pacer_report(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = timespec_diff_ns(&now, &pacer->start);
+    if(elapsed <= 0)
+	return;
+    printf("%lu frames in %.2fs, %.2fx real speed, %lu resyncs\n",
+	   pacer->total_frames, elapsed / 1e9,
+	   (double)pacer->total_frames * PACER_FRAME_NS / elapsed,
+	   pacer->resyncs);
+}
@@ -0,0 +1,45 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <time.h>
+
+#define PACER_FRAME_NS 16742706L // 70224 cycles at 4194304Hz, 59.7275Hz
+#define PACER_MAX_LAG_NS (4 * PACER_FRAME_NS) // give up catching up after this
+#define PACER_REPORT_NS 1000000000L // how often the speed is measured
+
+typedef enum {
+    PACER_EXACT, // real Game Boy speed
+    PACER_MULTIPLIER, // speed times real speed
+    PACER_UNCAPPED // never sleep
+} PacerMode;
+
+typedef struct{
+    PacerMode mode;
+    double speed;
+    _Atomic int fast_forward; // set from the UI thread, uncapped while set
+
+    struct timespec deadline; // absolute time the current frame should end
+    long late_ns; // how far past its deadline the last frame ended
+    unsigned long resyncs; // times we fell too far behind and gave up
+
+    /* emulated vs wall clock speed */
+    struct timespec window_start;
+    unsigned long window_frames;
+    double measured_speed;
+    unsigned long total_frames;
+    unsigned long frame_limit; // stop after this many frames, 0 never
+    struct timespec start;
+} Pacer;
+
+void pacer_init();
+void pacer_set_mode(const PacerMode mode, const double speed);
+PacerMode pacer_get_mode();
+long pacer_frame();
+double pacer_get_speed();
+void pacer_fast_forward(const int on);
+void pacer_set_frame_limit(const unsigned long frames);
+void pacer_report();
+
+extern _Thread_local Pacer *pacer;
+
+#endif
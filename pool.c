@@ -0,0 +1,340 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef LGB_NUMA
+#include <numa.h>
+#endif
+
+#include "pool.h"
+
+/* A cache line or more each, so one worker's counters and deque lock
+ * don't bounce between the others' cores */
+typedef struct{
+    _Alignas(64) pthread_spinlock_t lock; // guards the deque
+    size_t *tasks; // ring of the pool's capacity
+    size_t top; // oldest, thieves take from here
+    size_t bottom; // newest, the owner pushes and pops here
+
+    struct Pool *pool;
+    int id;
+    int cpu;
+    int node;
+    unsigned int seed; // for picking victims
+    pthread_t thread;
+
+    unsigned long tasks_run;
+    unsigned long steals;
+    long busy_ns;
+} PoolWorker;
+
+struct Pool{
+    int threads; // workers including the caller of pool_run
+    unsigned int options;
+    PoolWorker *workers;
+    size_t capacity; // entries in every deque
+    int *home; // worker that last finished each index, it starts there next
+    size_t homes;
+    long job_ns; // time spent in pool_run, for the utilization
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+    /* the current job, set under lock before the workers are woken */
+    unsigned long generation;
+    PoolTask task;
+    void *arg;
+    _Atomic size_t remaining; // indices not finished yet
+    int running; // workers still on the job
+    int stop;
+};
+
+static long elapsed_ns(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec) * 1000000000L +
+	(to->tv_nsec - from->tv_nsec);
+}
+
+static void push(PoolWorker *w, const size_t index){
+    pthread_spin_lock(&w->lock);
+    w->tasks[w->bottom++ % w->pool->capacity] = index;
+    pthread_spin_unlock(&w->lock);
+}
+
+static int pop(PoolWorker *w, size_t *index){
+    int found = 0;
+    pthread_spin_lock(&w->lock);
+    if(w->bottom != w->top){
+	*index = w->tasks[--w->bottom % w->pool->capacity];
+	found = 1;
+    }
+    pthread_spin_unlock(&w->lock);
+    return found;
+}
+
+static int steal(PoolWorker *victim, size_t *index){
+    int found = 0;
+    pthread_spin_lock(&victim->lock);
+    if(victim->bottom != victim->top){
+	*index = victim->tasks[victim->top++ % victim->pool->capacity];
+	found = 1;
+    }
+    pthread_spin_unlock(&victim->lock);
+    return found;
+}
+
+/* Tries every other worker from a random one on, those on the same NUMA
+ * node first */
+static int steal_any(PoolWorker *w, size_t *index){
+    Pool *pool = w->pool;
+    int first = rand_r(&w->seed) % pool->threads;
+    int passes = pool->options & POOL_NUMA && w->node >= 0 ? 2 : 1;
+    for(int pass = 0; pass < passes; pass++)
+	for(int i = 0; i < pool->threads; i++){
+	    PoolWorker *victim = &pool->workers[(first + i) % pool->threads];
+	    if(victim == w || (pass == 0 && passes == 2 && victim->node != w->node))
+		continue;
+	    if(steal(victim, index))
+		return 1;
+	}
+    return 0;
+}
+
+static void work(PoolWorker *w){
+    Pool *pool = w->pool;
+    struct timespec start, end;
+    size_t index;
+    while(atomic_load_explicit(&pool->remaining, memory_order_acquire)){
+	int node = -1;
+	if(pop(w, &index))
+	    node = pool->options & POOL_NUMA ? w->node : -1;
+	else if(steal_any(w, &index))
+	    w->steals++;
+	else{
+	    sched_yield(); // the rest are being run, one may come back
+	    continue;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int again = pool->task(pool->arg, index, node);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	w->busy_ns += elapsed_ns(&start, &end);
+	w->tasks_run++;
+	if(again){
+	    push(w, index);
+	}else{
+	    pool->home[index] = w->id;
+	    atomic_fetch_sub_explicit(&pool->remaining, 1, memory_order_acq_rel);
+	}
+    }
+}
+
+static void pin(PoolWorker *w){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+	fprintf(stderr, "Unable to pin pool worker %d to CPU %d\n", w->id, w->cpu);
+	w->cpu = -1;
+    }
+}
+
+static void *worker_main(void *arg){
+    PoolWorker *w = arg;
+    Pool *pool = w->pool;
+    unsigned long seen = 0;
+    if(w->cpu >= 0)
+	pin(w);
+    pthread_mutex_lock(&pool->lock);
+    for(;;){
+	while(pool->generation == seen && !pool->stop)
+	    pthread_cond_wait(&pool->start, &pool->lock);
+	if(pool->stop)
+	    break;
+	seen = pool->generation;
+	pthread_mutex_unlock(&pool->lock);
+	work(w);
+	pthread_mutex_lock(&pool->lock);
+	if(--pool->running == 0)
+	    pthread_cond_signal(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Worker i is pinned to the i-th CPU the process may run on, the caller
+ * of pool_run (worker 0) is left where it is */
+static void assign_cpus(Pool *pool){
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int count = 0;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	return;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	if(CPU_ISSET(cpu, &allowed))
+	    cpus[count++] = cpu;
+    for(int i = 1; i < pool->threads && count; i++)
+	pool->workers[i].cpu = cpus[i % count];
+#ifdef LGB_NUMA
+    if(pool->options & POOL_NUMA)
+	for(int i = 1; i < pool->threads; i++)
+	    pool->workers[i].node = numa_node_of_cpu(pool->workers[i].cpu);
+#endif
+}
+
+/* threads counts the caller, 0 for one per online CPU */
+Pool *pool_create(int threads, const unsigned int options){
+    if(threads <= 0)
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+	threads = 1;
+    Pool *pool = malloc(sizeof(Pool));
+    pool->threads = threads;
+    pool->options = options;
+#ifdef LGB_NUMA
+    if(numa_available() < 0)
+	pool->options &= ~POOL_NUMA;
+#else
+    pool->options &= ~POOL_NUMA;
+#endif
+    if(pool->options & POOL_NUMA)
+	pool->options |= POOL_PIN;
+    pool->workers = aligned_alloc(_Alignof(PoolWorker),
+				  sizeof(PoolWorker) * threads);
+    memset(pool->workers, 0, sizeof(PoolWorker) * threads);
+    pool->capacity = 0;
+    pool->home = NULL;
+    pool->homes = 0;
+    pool->job_ns = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->generation = 0;
+    pool->running = 0;
+    pool->stop = 0;
+    atomic_init(&pool->remaining, 0);
+    for(int i = 0; i < threads; i++){
+	PoolWorker *w = &pool->workers[i];
+	pthread_spin_init(&w->lock, PTHREAD_PROCESS_PRIVATE);
+	w->pool = pool;
+	w->id = i;
+	w->cpu = -1;
+	w->node = -1;
+	w->seed = i * 2654435761u + 1;
+    }
+    if(pool->options & POOL_PIN)
+	assign_cpus(pool);
+    for(int i = 1; i < threads; i++){
+	if(pthread_create(&pool->workers[i].thread, NULL, worker_main,
+			  &pool->workers[i]) != 0){
+	    fprintf(stderr, "Unable to start pool worker %d\n", i);
+	    pool->threads = i; // run with the ones we have
+	    break;
+	}
+    }
+    return pool;
+}
+
+void pool_destroy(Pool *pool){
+    if(!pool)
+	return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 1; i < pool->threads; i++)
+	pthread_join(pool->workers[i].thread, NULL);
+    for(int i = 0; i < pool->threads; i++){
+	pthread_spin_destroy(&pool->workers[i].lock);
+	free(pool->workers[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->workers);
+    free(pool->home);
+    free(pool);
+}
+
+int pool_threads(const Pool *pool){
+    return pool->threads;
+}
+
+/* Every index goes on the deque of the worker that finished it last
+ * time, at first each worker gets an even, contiguous share */
+static void seed(Pool *pool, const size_t count){
+    if(count > pool->capacity){
+	for(int i = 0; i < pool->threads; i++)
+	    pool->workers[i].tasks = realloc(pool->workers[i].tasks,
+					     sizeof(size_t) * count);
+	pool->capacity = count;
+    }
+    if(count != pool->homes){
+	pool->home = realloc(pool->home, sizeof(int) * count);
+	for(size_t i = 0; i < count; i++)
+	    pool->home[i] = i * pool->threads / count;
+	pool->homes = count;
+    }
+    for(int i = 0; i < pool->threads; i++)
+	pool->workers[i].top = pool->workers[i].bottom = 0;
+    /* backwards so each worker pops its share lowest index first */
+    for(size_t i = count; i-- > 0;){
+	PoolWorker *w = &pool->workers[pool->home[i]];
+	w->tasks[w->bottom++] = i;
+    }
+}
+
+/* Calls task(arg, i, node) for every i below count, again each time it
+ * returns nonzero, and returns when all of them have returned 0. Only
+ * one thread may run jobs on a pool at a time */
+void pool_run(Pool *pool, PoolTask task, void *arg, size_t count){
+    struct timespec start, end;
+    if(!count)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    seed(pool, count);
+    atomic_store_explicit(&pool->remaining, count, memory_order_relaxed);
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->running = pool->threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running)
+	pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pool->job_ns += elapsed_ns(&start, &end);
+}
+
+/* Fills in up to max workers' counters since the pool was made or last
+ * reset and returns how many workers there are. Not during a job */
+int pool_stats(const Pool *pool, PoolWorkerStats *stats, int max){
+    for(int i = 0; i < pool->threads && i < max; i++){
+	const PoolWorker *w = &pool->workers[i];
+	stats[i].cpu = w->cpu;
+	stats[i].node = w->node;
+	stats[i].tasks = w->tasks_run;
+	stats[i].steals = w->steals;
+	stats[i].utilization = pool->job_ns ?
+	    (double)w->busy_ns / pool->job_ns : 0;
+    }
+    return pool->threads;
+}
+
+void pool_reset_stats(Pool *pool){
+    for(int i = 0; i < pool->threads; i++){
+	pool->workers[i].tasks_run = 0;
+	pool->workers[i].steals = 0;
+	pool->workers[i].busy_ns = 0;
+    }
+    pool->job_ns = 0;
+}
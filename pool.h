@@ -0,0 +1,39 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Work stealing pool for stepping many emulator instances at once. Every
+ * worker has its own deque of indices, pops from its bottom and steals
+ * from the top of the others' when it runs dry. A task that returns
+ * nonzero goes back on the deque of the worker that ran it, so a long
+ * job can be cut into short tasks (an instance's frames) that idle
+ * workers pick up between. The calling thread works on the job too. */
+
+typedef enum {
+    POOL_PIN = 1, // pin each worker to its own CPU
+    POOL_NUMA = 2 // tell tasks which node to keep their memory on, pins
+} PoolOption;
+
+/* node is the NUMA node of the worker that popped index from its own
+ * deque, -1 when the task was stolen or the pool isn't NUMA aware */
+typedef int (*PoolTask)(void *arg, size_t index, int node);
+
+typedef struct{
+    int cpu; // pinned to, -1 if not
+    int node;
+    unsigned long tasks;
+    unsigned long steals; // tasks taken from another worker's deque
+    double utilization; // time in tasks over time in jobs, 0 to 1
+} PoolWorkerStats;
+
+typedef struct Pool Pool;
+
+Pool *pool_create(int threads, const unsigned int options);
+void pool_destroy(Pool *pool);
+int pool_threads(const Pool *pool);
+void pool_run(Pool *pool, PoolTask task, void *arg, size_t count);
+int pool_stats(const Pool *pool, PoolWorkerStats *stats, int max);
+void pool_reset_stats(Pool *pool);
+
+#endif
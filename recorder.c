@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "gameboy.h"
+
+#define RLE_MAGIC "LGBRLE1\n"
+
+struct Recorder{
+    /* single producer (emulation thread), single consumer (writer) */
+    Frame frames[RECORDER_QUEUE_SIZE];
+    _Atomic unsigned int head;
+    _Atomic unsigned int tail;
+    _Atomic int stop;
+
+    pthread_t thread;
+    FILE *file;
+    RecordFormat format;
+    RecordPolicy policy;
+
+    Frame previous; // last frame written, for RECORD_RLE
+    u8 encoded[2 * HEIGHT * WIDTH];
+
+    unsigned long written;
+    unsigned long dropped;
+    unsigned int high_water; // most frames ever waiting in the queue
+};
+
+RecordFormat recorder_format_for(const char *filename){
+    const char *dot = strrchr(filename, '.');
+    if(dot && strcmp(dot, ".y4m") == 0)
+	return RECORD_Y4M;
+    if(dot && strcmp(dot, ".rle") == 0)
+	return RECORD_RLE;
+    return RECORD_RAW;
+}
+
+static void write_header(Recorder *recorder){
+    switch(recorder->format){
+    case RECORD_Y4M:
+	/* 4194304Hz / 70224 cycles a frame */
+	fprintf(recorder->file, "YUV4MPEG2 W%d H%d F4194304:70224 Ip A1:1 Cmono\n",
+		WIDTH, HEIGHT);
+	break;
+    case RECORD_RLE:
+	fputs(RLE_MAGIC, recorder->file);
+	fputc(WIDTH, recorder->file);
+	fputc(HEIGHT, recorder->file);
+	break;
+    default:
+	break;
+    }
+}
+
+/* (count, value) byte pairs of the frame XORed with the one before, so a
+ * still picture is a few hundred bytes. Each frame is preceded by its
+ * encoded length as 4 little endian bytes. */
+static void write_rle(Recorder *recorder, const Frame *frame){
+    const u8 *now = (const u8 *)frame;
+    u8 *before = (u8 *)recorder->previous;
+    int length = 0;
+    int i = 0;
+    while(i < HEIGHT * WIDTH){
+	u8 value = now[i] ^ before[i];
+	int run = 1;
+	while(run < 255 && i + run < HEIGHT * WIDTH &&
+	      (now[i + run] ^ before[i + run]) == value)
+	    run++;
+	recorder->encoded[length++] = run;
+	recorder->encoded[length++] = value;
+	i += run;
+    }
+    memcpy(before, now, sizeof(Frame));
+    for(int b = 0; b < 4; b++)
+	fputc((length >> (b * 8)) & 0xFF, recorder->file);
+    fwrite(recorder->encoded, 1, length, recorder->file);
+}
+
+static void write_frame(Recorder *recorder, const Frame *frame){
+    switch(recorder->format){
+    case RECORD_Y4M:
+	fputs("FRAME\n", recorder->file);
+	gpu_convert_frame(frame, GPU_OUTPUT_GRAY8, recorder->encoded);
+	fwrite(recorder->encoded, 1, HEIGHT * WIDTH, recorder->file);
+	break;
+    case RECORD_RLE:
+	write_rle(recorder, frame);
+	break;
+    default:
+	fwrite(frame, 1, sizeof(Frame), recorder->file);
+	break;
+    }
+    recorder->written++;
+}
+
+static void *recorder_main(void *arg){
+    Recorder *recorder = arg;
+    unsigned int tail = atomic_load_explicit(&recorder->tail,
+					     memory_order_relaxed);
+    for(;;){
+	unsigned int head = atomic_load_explicit(&recorder->head,
+						 memory_order_acquire);
+	if(tail == head){
+	    if(atomic_load_explicit(&recorder->stop, memory_order_acquire))
+		return NULL;
+	    // a frame comes every 16ms at most, no need to spin for it
+	    usleep(1000);
+	    continue;
+	}
+	while(tail != head){
+	    write_frame(recorder, &recorder->frames[tail & (RECORDER_QUEUE_SIZE - 1)]);
+	    tail++;
+	    atomic_store_explicit(&recorder->tail, tail, memory_order_release);
+	}
+    }
+}
+
+int recorder_start(const char *filename, const RecordFormat format,
+		   const RecordPolicy policy){
+    FILE *file = fopen(filename, "wb");
+    if(!file){
+	fprintf(stderr, "Unable to open %s for recording\n", filename);
+	return -1;
+    }
+    Recorder *recorder = malloc(sizeof(Recorder));
+    recorder->file = file;
+    recorder->format = format;
+    recorder->policy = policy;
+    memset(recorder->previous, 0, sizeof(Frame));
+    recorder->written = 0;
+    recorder->dropped = 0;
+    recorder->high_water = 0;
+    atomic_init(&recorder->head, 0);
+    atomic_init(&recorder->tail, 0);
+    atomic_init(&recorder->stop, 0);
+    write_header(recorder);
+    if(pthread_create(&recorder->thread, NULL, recorder_main, recorder) != 0){
+	fprintf(stderr, "Unable to start the recorder thread\n");
+	fclose(file);
+	free(recorder);
+	return -1;
+    }
+    gameboy->recorder = recorder;
+    return 0;
+}
+
+void recorder_stop(){
+    Recorder *recorder = gameboy->recorder;
+    if(!recorder)
+	return;
+    atomic_store_explicit(&recorder->stop, 1, memory_order_release);
+    pthread_join(recorder->thread, NULL);
+    fclose(recorder->file);
+    printf("recorder: %lu frames written, %lu dropped, queue high water "
+	   "%u/%d\n", recorder->written, recorder->dropped,
+	   recorder->high_water, RECORDER_QUEUE_SIZE);
+    free(recorder);
+    gameboy->recorder = NULL;
+}
+
+/* Called with each presented frame */
+void recorder_frame(const Frame *frame){
+    Recorder *recorder = gameboy->recorder;
+    if(!recorder)
+	return;
+    unsigned int head = atomic_load_explicit(&recorder->head,
+					     memory_order_relaxed);
+    unsigned int queued = head - atomic_load_explicit(&recorder->tail,
+						      memory_order_acquire);
+    if(queued == RECORDER_QUEUE_SIZE){
+	if(recorder->policy == RECORD_DROP){
+	    recorder->dropped++;
+	    return;
+	}
+	while(head - atomic_load_explicit(&recorder->tail, memory_order_acquire)
+	      == RECORDER_QUEUE_SIZE)
+	    sched_yield();
+	queued = head - atomic_load_explicit(&recorder->tail,
+					     memory_order_acquire);
+    }
+    memcpy(recorder->frames[head & (RECORDER_QUEUE_SIZE - 1)], frame,
+	   sizeof(Frame));
+    atomic_store_explicit(&recorder->head, head + 1, memory_order_release);
+    if(queued + 1 > recorder->high_water)
+	recorder->high_water = queued + 1;
+}
@@ -0,0 +1,32 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "types.h"
+#include "gpu.h"
+
+/* Records every presented frame to disk. Frames are copied into a queue
+ * at swap time and a writer thread encodes and writes them, so the
+ * emulator never waits on the disk unless it is asked to. */
+
+#define RECORDER_QUEUE_SIZE 64 // frames, must be a power of 2
+
+typedef struct Recorder Recorder;
+
+typedef enum {
+    RECORD_RAW, // 160x144 bytes of shades 0-3 a frame
+    RECORD_Y4M, // monochrome YUV4MPEG2, plays in most video tools
+    RECORD_RLE // shades XORed with the last frame, then run length coded
+} RecordFormat;
+
+typedef enum {
+    RECORD_DROP, // lose frames when the writer falls behind
+    RECORD_BLOCK // wait for the writer instead
+} RecordPolicy;
+
+int recorder_start(const char *filename, const RecordFormat format,
+		   const RecordPolicy policy);
+void recorder_stop();
+void recorder_frame(const Frame *frame);
+RecordFormat recorder_format_for(const char *filename);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "render_thread.h"
+#include "gpu.h"
+#include "mem.h"
+#include "gameboy.h"
+
+typedef enum {
+    RENDER_WRITE,
+    RENDER_LINE,
+    RENDER_FRAME,
+    RENDER_STOP
+} RenderEventType;
+
+typedef struct {
+    u16 address; // or the line number for RENDER_LINE
+    u8 value;
+    u8 type;
+} RenderEvent;
+
+struct RenderThread{
+    /* single producer (emulation thread), single consumer (worker) */
+    RenderEvent events[RENDER_QUEUE_SIZE];
+    _Atomic unsigned int head;
+    _Atomic unsigned int tail;
+    unsigned int pending_head; // written but not yet published
+
+    pthread_t thread;
+    GPU *shadow;
+    u8 vram[0x2000];
+
+    unsigned int frames_submitted;
+    Gameboy *gb; // bound on the worker too, finished frames go to its recorder
+};
+
+static void publish(RenderThread *render){
+    atomic_store_explicit(&render->head, render->pending_head,
+			  memory_order_release);
+}
+
+static void push(RenderThread *render, const u8 type, const u16 address,
+		 const u8 value){
+    unsigned int head = render->pending_head;
+    if(head - atomic_load_explicit(&render->tail, memory_order_acquire)
+       == RENDER_QUEUE_SIZE){
+	/* Queue is full, let the worker see what we have and wait for room */
+	publish(render);
+	while(head - atomic_load_explicit(&render->tail, memory_order_acquire)
+	      == RENDER_QUEUE_SIZE)
+	    sched_yield();
+    }
+    RenderEvent *e = &render->events[head & (RENDER_QUEUE_SIZE - 1)];
+    e->type = type;
+    e->address = address;
+    e->value = value;
+    render->pending_head = head + 1;
+}
+
+static void *render_thread_main(void *arg){
+    RenderThread *render = arg;
+    gameboy_bind(render->gb);
+    unsigned int tail = atomic_load_explicit(&render->tail,
+					     memory_order_relaxed);
+    int idle = 0;
+    for(;;){
+	unsigned int head = atomic_load_explicit(&render->head,
+						 memory_order_acquire);
+	if(tail == head){
+	    /* Nothing to do, back off gently so an idle worker doesn't
+	     * hog a core while the emulator sleeps between frames */
+	    if(++idle < 64)
+		sched_yield();
+	    else
+		usleep(100);
+	    continue;
+	}
+	idle = 0;
+	while(tail != head){
+	    RenderEvent *e = &render->events[tail & (RENDER_QUEUE_SIZE - 1)];
+	    switch(e->type){
+	    case RENDER_WRITE:
+		gpu_apply_write(render->shadow, render->vram,
+				e->address, e->value);
+		break;
+	    case RENDER_LINE:
+		render->shadow->line = e->address;
+		gpu_render_scan(render->shadow, render->vram);
+		break;
+	    case RENDER_FRAME:
+		/* The shadow shares the frame ring with the emulated PPU */
+		gpu_finish_frame(render->shadow);
+		break;
+	    case RENDER_STOP:
+		atomic_store_explicit(&render->tail, tail + 1,
+				      memory_order_release);
+		return NULL;
+	    }
+	    tail++;
+	}
+	atomic_store_explicit(&render->tail, tail, memory_order_release);
+    }
+}
+
+void render_thread_start(){
+    if(gpu->backend != GPU_BACKEND_LINE){
+	fprintf(stderr, "The render thread needs the line renderer\n");
+	return;
+    }
+    RenderThread *render = malloc(sizeof(RenderThread));
+    render->shadow = malloc(sizeof(GPU));
+    memcpy(render->shadow, gpu, sizeof(GPU));
+    memcpy(render->vram, memory->vram, sizeof(render->vram));
+    atomic_init(&render->head, 0);
+    atomic_init(&render->tail, 0);
+    render->pending_head = 0;
+    render->frames_submitted = atomic_load(&gpu->frames->completed);
+    render->gb = gameboy;
+    if(pthread_create(&render->thread, NULL, render_thread_main, render) != 0){
+	fprintf(stderr, "Unable to start the render thread\n");
+	free(render->shadow);
+	free(render);
+	return;
+    }
+    gameboy->render = render;
+    gpu->threaded_render = 1;
+}
+
+void render_thread_stop(){
+    RenderThread *render = gameboy->render;
+    if(!render)
+	return;
+    push(render, RENDER_STOP, 0, 0);
+    publish(render);
+    pthread_join(render->thread, NULL);
+    gpu->threaded_render = 0;
+    free(render->shadow);
+    free(render);
+    gameboy->render = NULL;
+}
+
+void render_thread_write(const u16 address, const u8 value){
+    push(gameboy->render, RENDER_WRITE, address, value);
+}
+
+void render_thread_line(const int line){
+    RenderThread *render = gameboy->render;
+    push(render, RENDER_LINE, line, 0);
+    publish(render);
+}
+
+/* Called at the end of every emulated frame. Hands the frame over to the
+ * worker, waiting if it hasn't finished the one before so the emulator
+ * never gets more than a frame ahead of it. */
+void render_thread_frame(){
+    RenderThread *render = gameboy->render;
+    unsigned int previous = render->frames_submitted;
+    push(render, RENDER_FRAME, 0, 0);
+    publish(render);
+    render->frames_submitted++;
+    while(atomic_load_explicit(&gpu->frames->completed, memory_order_acquire)
+	  < previous)
+	sched_yield();
+}
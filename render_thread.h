@@ -0,0 +1,21 @@
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+
+#include "types.h"
+
+/* Optional worker that draws scanlines off the emulation thread. The
+ * emulation thread logs every write that affects rendering plus a marker
+ * for each finished line, the worker replays them onto its own copy of the
+ * PPU state so frame N is drawn while frame N+1 is being emulated. */
+
+#define RENDER_QUEUE_SIZE (1 << 16) // entries, must be a power of 2
+
+typedef struct RenderThread RenderThread;
+
+void render_thread_start();
+void render_thread_stop();
+void render_thread_write(const u16 address, const u8 value);
+void render_thread_line(const int line);
+void render_thread_frame();
+
+#endif
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rewind.h"
+#include "savestate.h"
+#include "gameboy.h"
+
+#define PAGE_SIZE 256 // of the dirty bitmaps in Memory
+#define MAX_CLEAN_RANGES ((0x2000 + 0x2000 + 0x8000) / PAGE_SIZE)
+
+/* A state older than the newest, in the arena as the buttons of the
+ * interval frames that followed it and then its delta */
+typedef struct{
+    size_t offset;
+    size_t size;
+} RewindRecord;
+
+/* Bytes of the states known to be the same */
+typedef struct{
+    size_t start;
+    size_t end;
+} Range;
+
+struct Rewind{
+    unsigned int interval;
+    size_t state_size;
+    SavestateLayout layout;
+    u8 *head; // the newest state, whole
+    u8 *scratch; // the state being taken
+    u8 *encoded; // its delta, room for the worst case
+    u8 *buttons; // of the frames run since head
+    unsigned int frames;
+
+    /* Records one after the other, going round. Everything from write
+     * on is older than everything before it */
+    u8 *arena;
+    size_t capacity;
+    size_t write;
+    size_t used;
+    RewindRecord *records; // ring, oldest at first
+    size_t record_capacity;
+    size_t first;
+    size_t count;
+
+    unsigned long states;
+    long encode_ns;
+};
+
+static u8 buttons_held(){
+    return (~joypad->rows[0] & 0x0F) | (~joypad->rows[1] & 0x0F) << 4;
+}
+
+static u8 *put_varint(u8 *out, size_t value){
+    while(value >= 0x80){
+	*out++ = value | 0x80;
+	value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static size_t get_varint(const u8 **in){
+    size_t value = 0;
+    int shift = 0;
+    u8 byte;
+    do{
+	byte = *(*in)++;
+	value |= (size_t)(byte & 0x7F) << shift;
+	shift += 7;
+    }while(byte & 0x80);
+    return value;
+}
+
+static int add_pages(Range *ranges, int count, const size_t base,
+		     const u32 *dirty, const int pages){
+    for(int page = 0; page < pages; page++){
+	if(dirty[page >> 5] & 1u << (page & 31))
+	    continue;
+	size_t start = base + page * PAGE_SIZE;
+	if(count && ranges[count - 1].end == start)
+	    ranges[count - 1].end += PAGE_SIZE;
+	else
+	    ranges[count++] = (Range){start, start + PAGE_SIZE};
+    }
+    return count;
+}
+
+/* Pages not written since the last state, in the order they are in a state */
+static int clean_ranges(const Rewind *rw, Range *ranges){
+    int count = add_pages(ranges, 0, rw->layout.vram, &memory->dirty_vram,
+			  sizeof(memory->vram) / PAGE_SIZE);
+    count = add_pages(ranges, count, rw->layout.wram, &memory->dirty_wram,
+		      sizeof(memory->wram) / PAGE_SIZE);
+    if(memory->eram_size)
+	count = add_pages(ranges, count, rw->layout.eram, memory->dirty_eram,
+			  memory->eram_size / PAGE_SIZE);
+    return count;
+}
+
+static void clear_dirty(){
+    memory->dirty_vram = 0;
+    memory->dirty_wram = 0;
+    memset(memory->dirty_eram, 0, sizeof(memory->dirty_eram));
+}
+
+/* older XOR newer as (equal bytes, differing bytes, their XOR) runs */
+static size_t encode(const u8 *older, const u8 *newer, const size_t size,
+		     const Range *clean, const int count, u8 *out){
+    u8 *o = out;
+    size_t zeros = 0;
+    size_t i = 0;
+    for(int c = 0; c <= count; c++){
+	size_t end = c < count ? clean[c].start : size;
+	while(i < end){
+	    if(end - i >= 8 && memcmp(older + i, newer + i, 8) == 0){
+		i += 8;
+		zeros += 8;
+		continue;
+	    }
+	    if(older[i] == newer[i]){
+		i++;
+		zeros++;
+		continue;
+	    }
+	    size_t start = i;
+	    while(i < end && older[i] != newer[i])
+		i++;
+	    o = put_varint(o, zeros);
+	    o = put_varint(o, i - start);
+	    for(; start < i; start++)
+		*o++ = older[start] ^ newer[start];
+	    zeros = 0;
+	}
+	if(c < count){
+	    zeros += clean[c].end - clean[c].start;
+	    i = clean[c].end;
+	}
+    }
+    return o - out;
+}
+
+static void apply(u8 *state, const u8 *delta, const size_t size){
+    const u8 *end = delta + size;
+    size_t pos = 0;
+    while(delta < end){
+	pos += get_varint(&delta);
+	size_t count = get_varint(&delta);
+	while(count--)
+	    state[pos++] ^= *delta++;
+    }
+}
+
+static RewindRecord *oldest(Rewind *rw){
+    return &rw->records[rw->first];
+}
+
+static RewindRecord *newest(Rewind *rw){
+    return &rw->records[(rw->first + rw->count - 1) % rw->record_capacity];
+}
+
+static void drop_oldest(Rewind *rw){
+    rw->used -= oldest(rw)->size;
+    rw->first = (rw->first + 1) % rw->record_capacity;
+    rw->count--;
+}
+
+static void grow_records(Rewind *rw){
+    size_t capacity = rw->record_capacity * 2;
+    RewindRecord *records = malloc(sizeof(RewindRecord) * capacity);
+    for(size_t i = 0; i < rw->count; i++)
+	records[i] = rw->records[(rw->first + i) % rw->record_capacity];
+    free(rw->records);
+    rw->records = records;
+    rw->record_capacity = capacity;
+    rw->first = 0;
+}
+
+/* Keeps the delta of head against the state after it, making room by
+ * dropping the oldest */
+static void store(Rewind *rw, const size_t delta_size){
+    size_t need = rw->interval + delta_size;
+    if(need > rw->capacity){
+	fprintf(stderr, "Rewind state of %zu bytes is over the budget, "
+		"history lost\n", need);
+	rw->count = 0;
+	rw->used = 0;
+	rw->write = 0;
+	return;
+    }
+    if(rw->write + need > rw->capacity){
+	while(rw->count && oldest(rw)->offset >= rw->write)
+	    drop_oldest(rw); // left at the end, go round
+	rw->write = 0;
+    }
+    while(rw->count && oldest(rw)->offset >= rw->write &&
+	  oldest(rw)->offset < rw->write + need)
+	drop_oldest(rw);
+    if(rw->count == rw->record_capacity)
+	grow_records(rw);
+    rw->count++;
+    *newest(rw) = (RewindRecord){rw->write, need};
+    memcpy(rw->arena + rw->write, rw->buttons, rw->interval);
+    memcpy(rw->arena + rw->write + rw->interval, rw->encoded, delta_size);
+    rw->write += need;
+    rw->used += need;
+}
+
+static long elapsed_ns(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec) * 1000000000L +
+	(to->tv_nsec - from->tv_nsec);
+}
+
+void rewind_reset(Rewind *rw){
+    rw->frames = 0;
+    rw->count = 0;
+    rw->first = 0;
+    rw->used = 0;
+    rw->write = 0;
+    savestate_save(rw->head, rw->state_size);
+    clear_dirty();
+}
+
+Rewind *rewind_create(unsigned int interval, const size_t budget){
+    if(interval < 2)
+	interval = 2;
+    Rewind *rw = malloc(sizeof(Rewind));
+    rw->interval = interval;
+    rw->state_size = savestate_size();
+    savestate_layout(&rw->layout);
+    rw->head = malloc(rw->state_size);
+    rw->scratch = malloc(rw->state_size);
+    rw->encoded = malloc(rw->state_size * 2 + 16);
+    rw->buttons = malloc(interval);
+    rw->arena = malloc(budget);
+    rw->capacity = budget;
+    rw->record_capacity = 64;
+    rw->records = malloc(sizeof(RewindRecord) * rw->record_capacity);
+    rw->states = 0;
+    rw->encode_ns = 0;
+    rewind_reset(rw);
+    return rw;
+}
+
+void rewind_destroy(Rewind *rw){
+    if(!rw)
+	return;
+    free(rw->head);
+    free(rw->scratch);
+    free(rw->encoded);
+    free(rw->buttons);
+    free(rw->arena);
+    free(rw->records);
+    free(rw);
+}
+
+void rewind_frame(Rewind *rw){
+    struct timespec start, end;
+    Range clean[MAX_CLEAN_RANGES];
+    rw->buttons[rw->frames++] = buttons_held();
+    if(rw->frames < rw->interval)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count = clean_ranges(rw, clean);
+    savestate_save(rw->scratch, rw->state_size);
+    store(rw, encode(rw->head, rw->scratch, rw->state_size, clean, count,
+		     rw->encoded));
+    u8 *head = rw->head;
+    rw->head = rw->scratch;
+    rw->scratch = head;
+    clear_dirty();
+    rw->frames = 0;
+    rw->states++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rw->encode_ns += elapsed_ns(&start, &end);
+}
+
+/* Runs frames from the state the instance is in with the buttons they
+ * had, as fast as it goes */
+static void replay(const u8 *buttons, const unsigned int frames){
+    PacerMode mode = pacer->mode;
+    double speed = pacer->speed;
+    unsigned long limit = pacer->frame_limit;
+    pacer_set_mode(PACER_UNCAPPED, 1.0);
+    for(unsigned int i = 0; i < frames; i++){
+	joypad_set_buttons(buttons[i]);
+	pacer_set_frame_limit(pacer->total_frames + 1);
+	cpu_resume();
+	cpu_run();
+    }
+    pacer_set_mode(mode, speed);
+    pacer_set_frame_limit(limit);
+}
+
+int rewind_step_back(Rewind *rw){
+    if(rw->frames == 0){
+	/* Into the interval before head, its state becomes head */
+	if(!rw->count)
+	    return -1;
+	RewindRecord record = *newest(rw);
+	memcpy(rw->buttons, rw->arena + record.offset, rw->interval);
+	apply(rw->head, rw->arena + record.offset + rw->interval,
+	      record.size - rw->interval);
+	rw->write = record.offset;
+	rw->used -= record.size;
+	rw->count--;
+	rw->frames = rw->interval;
+    }
+    if(rw->frames == 1){
+	/* Back on head, which is run up to from the state before so its
+	 * frame gets drawn */
+	if(!rw->count)
+	    return -1;
+	RewindRecord *record = newest(rw);
+	memcpy(rw->scratch, rw->head, rw->state_size);
+	apply(rw->scratch, rw->arena + record->offset + rw->interval,
+	      record->size - rw->interval);
+	if(savestate_load(rw->scratch, rw->state_size) != 0)
+	    return -1;
+	replay(rw->arena + record->offset, rw->interval);
+	rw->frames = 0;
+	return 0;
+    }
+    rw->frames--;
+    if(savestate_load(rw->head, rw->state_size) != 0)
+	return -1;
+    replay(rw->buttons, rw->frames);
+    return 0;
+}
+
+void rewind_stats(const Rewind *rw, RewindStats *stats){
+    unsigned long frames = rw->count * rw->interval + rw->frames;
+    stats->frames = frames ? frames - 1 : 0;
+    stats->bytes = rw->used;
+    stats->states = rw->states;
+    stats->encode_ms = rw->encode_ns / 1e6;
+}
@@ -0,0 +1,42 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include "types.h"
+
+/* History of the bound instance to step back through a frame at a time.
+ * Every interval frames a save state is taken. The newest is kept whole,
+ * each older one only as the XOR with the one after it, run length coded
+ * so what didn't change costs next to nothing. VRAM, WRAM and cartridge
+ * RAM pages that weren't written in between aren't even compared. The
+ * buttons of every frame are kept too, so the frames between two states
+ * are run again from the older one when stepping back. The oldest states
+ * go when the history outgrows its budget. */
+
+#define REWIND_INTERVAL 8 // frames between states
+#define REWIND_BUDGET (8 << 20) // bytes of history
+
+typedef struct Rewind Rewind;
+
+typedef struct{
+    unsigned long frames; // that can be stepped back
+    size_t bytes; // of the budget in use
+    unsigned long states; // taken so far
+    double encode_ms; // spent taking and coding them
+} RewindStats;
+
+/* Starts the history at the state the bound instance is in. An interval
+ * below 2 is taken as 2 */
+Rewind *rewind_create(unsigned int interval, const size_t budget);
+void rewind_destroy(Rewind *rw);
+/* Call after every frame the bound instance runs */
+void rewind_frame(Rewind *rw);
+/* Puts the bound instance back to where it was a frame earlier, with
+ * that frame drawn unless the LCD was off for it. Returns 0, or -1 when
+ * the history has run out */
+int rewind_step_back(Rewind *rw);
+/* Forgets the history, for when the instance was put somewhere else */
+void rewind_reset(Rewind *rw);
+void rewind_stats(const Rewind *rw, RewindStats *stats);
+
+#endif
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "savestate.h"
+#include "gameboy.h"
+
+#define STATE_MAGIC "LGBSTATE"
+#define MAGIC_SIZE 8
+#define HEADER_SIZE (MAGIC_SIZE + 4 + 2 + 1 + 4)
+#define SECTION_HEADER_SIZE 8
+#define NO_ROW 0xFFFFFFFF // fetch_row not pointing anywhere
+
+/* With data NULL only counts, which is how sizes are worked out */
+typedef struct{
+    u8 *data;
+    size_t pos;
+    SavestateLayout *layout; // filled in as the memories go past, or NULL
+} Writer;
+
+typedef struct{
+    const u8 *data;
+    size_t pos;
+} Reader;
+
+static void put8(Writer *w, const u8 value){
+    if(w->data)
+	w->data[w->pos] = value;
+    w->pos++;
+}
+
+static void put16(Writer *w, const u16 value){
+    put8(w, value & 0xFF);
+    put8(w, value >> 8);
+}
+
+static void put32(Writer *w, const u32 value){
+    put16(w, value & 0xFFFF);
+    put16(w, value >> 16);
+}
+
+static void put_bytes(Writer *w, const void *from, const size_t size){
+    if(w->layout){
+	if(from == memory->vram)
+	    w->layout->vram = w->pos;
+	else if(from == memory->wram)
+	    w->layout->wram = w->pos;
+	else if(from == memory->eram)
+	    w->layout->eram = w->pos;
+    }
+    if(w->data)
+	memcpy(w->data + w->pos, from, size);
+    w->pos += size;
+}
+
+/* Reads are only done once the section is known to be long enough */
+static u8 get8(Reader *r){
+    return r->data[r->pos++];
+}
+
+static u16 get16(Reader *r){
+    u16 low = get8(r);
+    return low | get8(r) << 8;
+}
+
+static u32 get32(Reader *r){
+    u32 low = get16(r);
+    return low | (u32)get16(r) << 16;
+}
+
+static void get_bytes(Reader *r, void *to, const size_t size){
+    memcpy(to, r->data + r->pos, size);
+    r->pos += size;
+}
+
+static u16 rom_checksum(){
+    return memory->rom ? memory->rom[0x14E] << 8 | memory->rom[0x14F] : 0;
+}
+
+static void save_cpu(Writer *w){
+    put8(w, cpu->A);
+    put8(w, cpu->F);
+    put8(w, cpu->B);
+    put8(w, cpu->C);
+    put8(w, cpu->D);
+    put8(w, cpu->E);
+    put8(w, cpu->H);
+    put8(w, cpu->L);
+    put16(w, cpu->PC);
+    put16(w, cpu->SP);
+    put8(w, cpu->interrupt_master_enable);
+    put8(w, cpu->cpu_halt);
+    put8(w, cpu->cpu_stop);
+    put8(w, cpu->PC_skip);
+    put8(w, cpu->interrupt_skip);
+}
+
+static void load_cpu(Reader *r){
+    cpu->A = get8(r);
+    cpu->F = get8(r);
+    cpu->B = get8(r);
+    cpu->C = get8(r);
+    cpu->D = get8(r);
+    cpu->E = get8(r);
+    cpu->H = get8(r);
+    cpu->L = get8(r);
+    cpu->PC = get16(r);
+    cpu->SP = get16(r);
+    cpu->interrupt_master_enable = get8(r);
+    cpu->cpu_halt = get8(r);
+    cpu->cpu_stop = get8(r);
+    cpu->PC_skip = get8(r);
+    cpu->interrupt_skip = get8(r);
+}
+
+static void save_memory(Writer *w){
+    MemoryBankController *mbc = &memory->memory_bank_controllers;
+    put_bytes(w, memory->vram, sizeof(memory->vram));
+    put_bytes(w, memory->wram, sizeof(memory->wram));
+    put_bytes(w, memory->oam, sizeof(memory->oam));
+    put_bytes(w, memory->zram, sizeof(memory->zram));
+    put8(w, memory->interrupt_enable);
+    put8(w, memory->interrupt_flags);
+    put8(w, memory->in_bios);
+    put32(w, memory->ram_banks);
+    put32(w, memory->rom_offset);
+    put32(w, memory->ram_offset);
+    put8(w, memory->memory_bank_controller);
+    put32(w, mbc->rom_bank);
+    put32(w, mbc->ram_bank);
+    put8(w, mbc->ram_on);
+    put8(w, mbc->ram_battery);
+    put8(w, mbc->mode);
+}
+
+static void load_memory(Reader *r){
+    MemoryBankController *mbc = &memory->memory_bank_controllers;
+    get_bytes(r, memory->vram, sizeof(memory->vram));
+    get_bytes(r, memory->wram, sizeof(memory->wram));
+    get_bytes(r, memory->oam, sizeof(memory->oam));
+    get_bytes(r, memory->zram, sizeof(memory->zram));
+    memory->interrupt_enable = get8(r);
+    memory->interrupt_flags = get8(r);
+    memory->in_bios = get8(r);
+    memory->ram_banks = get32(r);
+    memory->rom_offset = get32(r);
+    memory->ram_offset = get32(r);
+    memory->memory_bank_controller = get8(r);
+    mbc->rom_bank = get32(r);
+    mbc->ram_bank = get32(r);
+    mbc->ram_on = get8(r);
+    mbc->ram_battery = get8(r);
+    mbc->mode = get8(r);
+}
+
+static void save_eram(Writer *w){
+    put_bytes(w, memory->eram, memory->eram_size);
+}
+
+static void load_eram(Reader *r){
+    get_bytes(r, memory->eram, memory->eram_size);
+}
+
+/* Only what isn't decoded from VRAM, OAM or a register, gpu_reload
+ * rebuilds the rest */
+static void save_gpu(Writer *w){
+    put32(w, gpu->clock);
+    put32(w, gpu->mode3_length);
+    put8(w, gpu->scroll_x);
+    put8(w, gpu->scroll_y);
+    put8(w, gpu->window_x);
+    put8(w, gpu->window_y);
+    put8(w, gpu->line);
+    put8(w, gpu->line_compare);
+    put8(w, gpu->stat_enable);
+    put8(w, gpu->stat_line);
+    put8(w, gpu->mode);
+    put32(w, gpu->curscan);
+    put32(w, gpu->pending);
+    put32(w, gpu->deadline);
+    put32(w, gpu->off_clock);
+    put8(w, gpu->skip_frame);
+    put8(w, gpu->lcd_control_register);
+    put8(w, gpu->background_palette);
+    put8(w, gpu->object_palette0);
+    put8(w, gpu->object_palette1);
+}
+
+static void load_gpu(Reader *r){
+    gpu->clock = (int)get32(r);
+    gpu->mode3_length = (int)get32(r);
+    gpu->scroll_x = get8(r);
+    gpu->scroll_y = get8(r);
+    gpu->window_x = get8(r);
+    gpu->window_y = get8(r);
+    gpu->line = get8(r);
+    gpu->line_compare = get8(r);
+    gpu->stat_enable = get8(r);
+    gpu->stat_line = get8(r);
+    gpu->mode = get8(r);
+    gpu->curscan = (int)get32(r);
+    gpu->pending = (int)get32(r);
+    gpu->deadline = (int)get32(r);
+    gpu->off_clock = (int)get32(r);
+    gpu->skip_frame = get8(r);
+    gpu->lcd_control_register = get8(r);
+    gpu->background_palette = get8(r);
+    gpu->object_palette0 = get8(r);
+    gpu->object_palette1 = get8(r);
+}
+
+static void save_fifo(Writer *w){
+    PixelFifo *f = &gpu->fifo;
+    put_bytes(w, f->bg, sizeof(f->bg));
+    put8(w, f->bg_head);
+    put8(w, f->bg_count);
+    put_bytes(w, f->obj_colour, sizeof(f->obj_colour));
+    put_bytes(w, f->obj_palette, sizeof(f->obj_palette));
+    put_bytes(w, f->obj_prio, sizeof(f->obj_prio));
+    put32(w, f->fetch_step);
+    put8(w, f->fetch_x);
+    put8(w, f->fetch_window);
+    put32(w, f->fetch_row ? (u32)(f->fetch_row - &gpu->tiles[0][0][0]) : NO_ROW);
+    put8(w, f->lcd_x);
+    put8(w, f->discard);
+    put8(w, f->stall);
+    put8(w, f->window_line);
+    put8(w, f->window_drawn);
+    for(int i = 0; i < MAX_LINE_SPRITES; i++)
+	put8(w, f->sprites[i]);
+    put8(w, f->sprite_count);
+    put16(w, f->sprite_fetched);
+}
+
+static void load_fifo(Reader *r){
+    PixelFifo *f = &gpu->fifo;
+    get_bytes(r, f->bg, sizeof(f->bg));
+    f->bg_head = get8(r);
+    f->bg_count = get8(r);
+    get_bytes(r, f->obj_colour, sizeof(f->obj_colour));
+    get_bytes(r, f->obj_palette, sizeof(f->obj_palette));
+    get_bytes(r, f->obj_prio, sizeof(f->obj_prio));
+    f->fetch_step = (int)get32(r);
+    f->fetch_x = get8(r);
+    f->fetch_window = get8(r);
+    u32 row = get32(r);
+    f->fetch_row = row <= sizeof(gpu->tiles) - 8 ? &gpu->tiles[0][0][0] + row : NULL;
+    f->lcd_x = get8(r);
+    f->discard = get8(r);
+    f->stall = get8(r);
+    f->window_line = get8(r);
+    f->window_drawn = get8(r);
+    for(int i = 0; i < MAX_LINE_SPRITES; i++)
+	f->sprites[i] = get8(r);
+    f->sprite_count = get8(r);
+    f->sprite_fetched = get16(r);
+}
+
+static void save_timer(Writer *w){
+    put32(w, timer->div);
+    put32(w, timer->_div);
+    put32(w, timer->tima);
+    put32(w, timer->timo);
+    put32(w, timer->tac);
+}
+
+static void load_timer(Reader *r){
+    timer->div = get32(r);
+    timer->_div = get32(r);
+    timer->tima = get32(r);
+    timer->timo = get32(r);
+    timer->tac = get32(r);
+}
+
+/* The rows are the frontend's buttons, not machine state */
+static void save_joypad(Writer *w){
+    put8(w, joypad->column);
+}
+
+static void load_joypad(Reader *r){
+    joypad->column = get8(r);
+}
+
+typedef struct{
+    char tag[5];
+    void (*save)(Writer *w);
+    void (*load)(Reader *r);
+    int required;
+} Section;
+
+/* Written in this order, loaded in any. Fields are only ever appended to
+ * a section, anything else gets a new tag or a new version */
+static const Section sections[] = {
+    {"CPU ", save_cpu, load_cpu, 1},
+    {"MEM ", save_memory, load_memory, 1},
+    {"ERAM", save_eram, load_eram, 0},
+    {"GPU ", save_gpu, load_gpu, 1},
+    {"FIFO", save_fifo, load_fifo, 0},
+    {"TIMR", save_timer, load_timer, 1},
+    {"JOYP", save_joypad, load_joypad, 0},
+};
+#define SECTIONS (sizeof(sections) / sizeof(sections[0]))
+
+static size_t section_size(const Section *section){
+    Writer counter = {NULL, 0, NULL};
+    section->save(&counter);
+    return counter.pos;
+}
+
+static void write_state(Writer *w){
+    put_bytes(w, STATE_MAGIC, MAGIC_SIZE);
+    put32(w, SAVESTATE_VERSION);
+    put16(w, rom_checksum());
+    put8(w, memory->rom_banks);
+    put32(w, memory->eram_size);
+    for(size_t i = 0; i < SECTIONS; i++){
+	size_t size = section_size(&sections[i]);
+	if(!size)
+	    continue; // no cartridge RAM
+	put_bytes(w, sections[i].tag, 4);
+	put32(w, size);
+	sections[i].save(w);
+    }
+    put_bytes(w, "END ", 4);
+    put32(w, 0);
+}
+
+size_t savestate_size(){
+    Writer counter = {NULL, 0, NULL};
+    write_state(&counter);
+    return counter.pos;
+}
+
+void savestate_layout(SavestateLayout *layout){
+    Writer counter = {NULL, 0, layout};
+    memset(layout, 0, sizeof(SavestateLayout));
+    write_state(&counter);
+}
+
+size_t savestate_save(u8 *buffer, const size_t size){
+    size_t needed = savestate_size();
+    if(!buffer || size < needed)
+	return needed;
+    Writer w = {buffer, 0, NULL};
+    write_state(&w);
+    return needed;
+}
+
+static const Section *find_section(const u8 *tag){
+    for(size_t i = 0; i < SECTIONS; i++)
+	if(memcmp(sections[i].tag, tag, 4) == 0)
+	    return &sections[i];
+    return NULL;
+}
+
+/* Everything is checked before anything is loaded, so a bad state leaves
+ * the instance as it was */
+static int check_state(const u8 *buffer, const size_t size){
+    Reader r = {buffer, MAGIC_SIZE};
+    int found[SECTIONS] = {0};
+    if(size < HEADER_SIZE || memcmp(buffer, STATE_MAGIC, MAGIC_SIZE) != 0){
+	fprintf(stderr, "Not a save state\n");
+	return -1;
+    }
+    u32 version = get32(&r);
+    if(version != SAVESTATE_VERSION){
+	fprintf(stderr, "Save state version %u, this build loads %d\n",
+		version, SAVESTATE_VERSION);
+	return -1;
+    }
+    u16 checksum = get16(&r);
+    u8 rom_banks = get8(&r);
+    u32 eram_size = get32(&r);
+    if(checksum != rom_checksum() || rom_banks != memory->rom_banks ||
+       eram_size != (u32)memory->eram_size){
+	fprintf(stderr, "Save state is for another game\n");
+	return -1;
+    }
+    for(;;){
+	if(size - r.pos < SECTION_HEADER_SIZE){
+	    fprintf(stderr, "Save state is cut short\n");
+	    return -1;
+	}
+	const u8 *tag = r.data + r.pos;
+	r.pos += 4;
+	u32 length = get32(&r);
+	if(memcmp(tag, "END ", 4) == 0)
+	    break;
+	if(length > size - r.pos){
+	    fprintf(stderr, "Save state section %.4s is cut short\n", tag);
+	    return -1;
+	}
+	const Section *section = find_section(tag);
+	if(section){
+	    size_t needed = section_size(section);
+	    if(length < needed || (section->load == load_eram && length != needed)){
+		fprintf(stderr, "Save state section %.4s is %u bytes, expected %zu\n",
+			tag, length, needed);
+		return -1;
+	    }
+	    found[section - sections] = 1;
+	}
+	r.pos += length;
+    }
+    for(size_t i = 0; i < SECTIONS; i++){
+	int required = sections[i].required ||
+	    (sections[i].load == load_eram && memory->eram_size);
+	if(required && !found[i]){
+	    fprintf(stderr, "Save state has no %.4s section\n", sections[i].tag);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+int savestate_load(const u8 *buffer, const size_t size){
+    if(check_state(buffer, size) != 0)
+	return -1;
+    Reader r = {buffer, HEADER_SIZE};
+    for(;;){
+	const u8 *tag = r.data + r.pos;
+	r.pos += 4;
+	u32 length = get32(&r);
+	if(memcmp(tag, "END ", 4) == 0)
+	    break;
+	const Section *section = find_section(tag);
+	if(section){
+	    Reader fields = {r.data + r.pos, 0};
+	    section->load(&fields);
+	}
+	r.pos += length;
+    }
+    gpu_reload();
+    mem_mark_dirty();
+    return 0;
+}
+
+int savestate_save_file(const char *filename){
+    size_t size = savestate_size();
+    u8 *buffer = malloc(size);
+    savestate_save(buffer, size);
+    FILE *file = fopen(filename, "wb");
+    if(!file){
+	fprintf(stderr, "Unable to open %s\n", filename);
+	free(buffer);
+	return -1;
+    }
+    int result = fwrite(buffer, 1, size, file) == size ? 0 : -1;
+    if(fclose(file) != 0 || result != 0){
+	fprintf(stderr, "Unable to write %s\n", filename);
+	result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+int savestate_load_file(const char *filename){
+    FILE *file = fopen(filename, "rb");
+    if(!file){
+	fprintf(stderr, "Unable to open %s\n", filename);
+	return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if(size <= 0){
+	fprintf(stderr, "Unable to read %s\n", filename);
+	fclose(file);
+	return -1;
+    }
+    u8 *buffer = malloc(size);
+    int result = -1;
+    if(fread(buffer, 1, size, file) == (size_t)size)
+	result = savestate_load(buffer, size);
+    else
+	fprintf(stderr, "Unable to read %s\n", filename);
+    fclose(file);
+    free(buffer);
+    return result;
+}
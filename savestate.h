@@ -0,0 +1,47 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+#include "types.h"
+
+/* Save states of the bound instance. A state is a header followed by
+ * sections, each a four character tag, a little endian 32 bit length and
+ * the section's fields written out one by one:
+ *
+ *   "LGBSTATE" u32 version
+ *   "CPU " registers, interrupt and halt state
+ *   "MEM " VRAM, WRAM, OAM, ZRAM, interrupt registers, banking
+ *   "ERAM" cartridge RAM, only when the cartridge has some
+ *   "GPU " LCD registers, mode, clock, line and timing
+ *   "FIFO" the pixel FIFO's position in the line
+ *   "TIMR" divider and timer registers
+ *   "JOYP" joypad row select
+ *   "END "
+ *
+ * Tiles, sprites and everything else decoded from VRAM, OAM and the
+ * registers are rebuilt on load. Loaders skip sections they don't know,
+ * so sections can be added without a new version. A state only loads
+ * into an instance with the same game. */
+
+#define SAVESTATE_VERSION 1
+
+size_t savestate_size();
+/* Writes the state to buffer and returns its size. With a NULL or too
+ * small buffer nothing is written and the size needed is returned */
+size_t savestate_save(u8 *buffer, const size_t size);
+/* Returns 0, or -1 and says why on stderr */
+int savestate_load(const u8 *buffer, const size_t size);
+
+/* Where the bound instance's states keep VRAM, WRAM and the cartridge
+ * RAM, as offsets into them, for comparing states page by page */
+typedef struct{
+    size_t vram;
+    size_t wram;
+    size_t eram; // 0 without cartridge RAM
+} SavestateLayout;
+void savestate_layout(SavestateLayout *layout);
+
+int savestate_save_file(const char *filename);
+int savestate_load_file(const char *filename);
+
+#endif
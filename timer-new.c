@@ -3,7 +3,7 @@
 #include "timer-new.h"
 #include "mem.h"
 
-Timer *timer;
+_Thread_local Timer *timer;
 
 void timer_init() {
     timer = malloc(sizeof(Timer));
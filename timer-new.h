@@ -18,6 +18,6 @@ typedef struct{
     unsigned int tac; // timer control
 } Timer;
 
-extern Timer *timer;
+extern _Thread_local Timer *timer;
 
 #endif